@@ -132,7 +132,7 @@ int luaLM_getfd (lua_State *L, int i)
     lua_pop(L, 1);
   }
   { // Lua file object (userdata)
-    FILE *f = *(FILE**)luaL_checkudata(L, 1, LUA_FILEHANDLE);
+    FILE *f = *(FILE**)luaL_checkudata(L, i, LUA_FILEHANDLE);
     if (!f) return -1;
     return fileno(f);
   }
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "byte.h"
 #include "debug.h"
@@ -22,24 +23,53 @@ static buflen_t good_size (buflen_t size)
   return newsize;
 }
 
+/// Drained buffers bigger than this give their memory back.
+#define BUFFER_SHRINK_SIZE (256*1024)
+
+struct buffer_chunk *buffer_chunk_ref (struct buffer_chunk *c)
+{
+  c->refs++;
+  return c;
+}
+
+void buffer_chunk_unref (struct buffer_chunk *c)
+{
+  if (c && !--c->refs) free (c);
+}
+
+void buffer_release (struct buffer *b)
+{
+  buffer_chunk_unref (b->chunk);
+  *b = (struct buffer){ .data = 0 };
+}
+
+/// Makes room for `space` bytes after the data. The unread data is moved to the front of the
+/// buffer only when nothing else references the chunk and the move is cheap compared to the
+/// already consumed part (otherwise a new chunk is allocated).
 int buffer_ensure (struct buffer *b, buflen_t space)
 {
   if (b->data) {
+    buflen_t used = b->end - b->start;
+    int shared = b->chunk->refs > 1;
+    if (!used && !shared) { b->start = b->end = 0; }
     buflen_t free = b->size - b->end;
     if (free >= space) { return 1; }
     free += b->start;
-    if (free >= space) {
-      byte_copy (b->data, b->end - b->start, b->data + b->start);
-      b->end -= b->start; b->start = 0;
+    if (!shared && free >= space && used <= b->start) {
+      memmove (b->data, b->data + b->start, used);
+      b->end = used; b->start = 0;
       return 1;
     }
   }
   buflen_t nsize = good_size (b->end - b->start + space);
-  uint8_t *ndata = malloc (nsize);
-  if (!ndata) return 0;
-  byte_copy (ndata, b->end - b->start, b->data + b->start);
-  if (b->data) free (b->data);
-  b->data = ndata;
+  struct buffer_chunk *nc = malloc (sizeof(struct buffer_chunk) + nsize);
+  if (!nc) return 0;
+  nc->refs = 1;
+  nc->size = nsize;
+  if (b->data) byte_copy (nc->data, b->end - b->start, b->data + b->start);
+  buffer_chunk_unref (b->chunk);
+  b->chunk = nc;
+  b->data = nc->data;
   b->size = nsize;
   b->end -= b->start; b->start = 0;
   return 1;
@@ -54,6 +84,8 @@ buflen_t buffer_rpeek (struct buffer *b, const uint8_t **s)
 void buffer_rseek (struct buffer *b, buflen_t n)
 {
   b->start += n;
+  b->scan = b->scan > n ? b->scan - n : 0;
+  if (b->start == b->end && b->size > BUFFER_SHRINK_SIZE) buffer_release (b);
 }
 
 buflen_t buffer_wpeek (struct buffer *b, uint8_t **s)
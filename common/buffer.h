@@ -1,10 +1,20 @@
 typedef size_t buflen_t;
 
+/// Reference counted storage of a buffer. Buffer slices keep a reference to the chunk
+/// they point into, so the buffer never moves or overwrites data which is still referenced.
+struct buffer_chunk {
+  unsigned refs;
+  buflen_t size;
+  uint8_t data[];
+};
+
 struct buffer {
-  uint8_t *data;
+  uint8_t *data;  // chunk->data (or NULL)
   buflen_t start; // first byte containing data (unless start == end)
   buflen_t end;   // first free byte after the data
   buflen_t size;
+  buflen_t scan;  // bytes (after start) already searched by readuntil
+  struct buffer_chunk *chunk;
 };
 
 int buffer_ensure (struct buffer *b, buflen_t space);
@@ -13,3 +23,7 @@ void buffer_rseek (struct buffer *b, buflen_t n);
 buflen_t buffer_wpeek (struct buffer *b, uint8_t **s);
 void buffer_wseek (struct buffer *b, buflen_t n);
 int buffer_write (struct buffer *b, const void *s, buflen_t len);
+void buffer_release (struct buffer *b);
+
+struct buffer_chunk *buffer_chunk_ref (struct buffer_chunk *c);
+void buffer_chunk_unref (struct buffer_chunk *c);
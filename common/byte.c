@@ -1,6 +1,10 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "byte.h"
 
@@ -13,10 +17,8 @@ void byte_copy (void *_d, size_t n, const void *_s)
 
 size_t byte_findc (const void *_s, size_t sn, uint8_t c)
 {
-  const uint8_t *s = _s;
-  size_t i = 0;
-  while (sn-- && *s++ != c) i++;
-  return i;
+  const uint8_t *p = memchr (_s, c, sn);
+  return p ? (size_t)(p - (const uint8_t *)_s) : sn;
 }
 
 int byte_diff (const void *_s, size_t sn, const void *_x)
@@ -27,15 +29,41 @@ int byte_diff (const void *_s, size_t sn, const void *_x)
   return 0;
 }
 
+/// Returns the offset of the first occurence of `tok` in `s` (or `sn` if there is none).
+///
+/// With SSE2 16 positions are checked at once by comparing the first and the last byte of the
+/// token, the rest is compared only for the candidates which passed this filter. Otherwise (and
+/// for the remaining tail) `memchr` is used to skip to the candidates.
 size_t byte_find (const void *_s, size_t sn, const void *tok, size_t tokn)
 {
-  const uint8_t *s = _s;
-  size_t osn = sn;
-  while (sn >= tokn) {
-    if (!byte_diff (s, tokn, tok)) return osn - sn;
-    s++; sn--;
+  const uint8_t *s = _s, *t = tok;
+  if (!tokn) return 0;
+  if (tokn == 1) return byte_findc (s, sn, t[0]);
+  if (sn < tokn) return sn;
+  size_t last = sn - tokn; // last possible match position
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8 (t[0]);
+  const __m128i tail = _mm_set1_epi8 (t[tokn - 1]);
+  for (; i + 16 <= last + 1; i += 16) {
+    __m128i bf = _mm_loadu_si128 ((const __m128i *)(s + i));
+    __m128i bl = _mm_loadu_si128 ((const __m128i *)(s + i + tokn - 1));
+    unsigned mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (bf, first), _mm_cmpeq_epi8 (bl, tail)));
+    while (mask) {
+      unsigned bit = __builtin_ctz (mask);
+      if (!memcmp (s + i + bit + 1, t + 1, tokn - 2)) return i + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  while (i <= last) {
+    const uint8_t *p = memchr (s + i, t[0], last - i + 1);
+    if (!p) break;
+    i = p - s;
+    if (!memcmp (p + 1, t + 1, tokn - 1)) return i;
+    i++;
   }
-  return osn;
+  return sn;
 }
 
 void *byte_dup (const void *s, size_t n)
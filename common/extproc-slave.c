@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <arpa/inet.h>
 
@@ -29,3 +30,17 @@ int connect_localhost (char *ioaddr)
 
   return sock;
 }
+
+#ifdef __linux__
+/// Attaches to the shared memory rings when ExtProc uses the 'shm' transport (`ioaddr` is then
+/// "shm:<memfd>:<doorbell>"). Returns NULL for other addresses.
+struct shmring *attach_shmring (char *ioaddr)
+{
+  if (strncmp (ioaddr, "shm:", 4) != 0)
+    return NULL;
+
+  struct shmring *r = shmring_attach (ioaddr);
+  if (!r) EXIT_ON_POSIX_ERROR("failed to attach to the shared memory rings", 2);
+  return r;
+}
+#endif
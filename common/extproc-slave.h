@@ -1 +1,6 @@
 int connect_localhost (char *ioaddr);
+
+#ifdef __linux__
+#include "../platform-linux/shmring.h"
+struct shmring *attach_shmring (char *ioaddr);
+#endif
@@ -5,6 +5,7 @@
 /// ## Necessary declarations
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -27,94 +28,248 @@ static lua_Number extract_number_64 (const uint8_t *s, size_t n, int le, int iss
 static lua_Number extract_float (const uint8_t *s, int flipendian);
 static lua_Number extract_double (const uint8_t *s, int flipendian);
 
-size_t lua_binary_unpack_ll (lua_State *L, const uint8_t *s, size_t n, const char *f, int *results)
+/// Format strings are compiled into plans: flat lists of operations with the endianess and
+/// sizes already resolved. Plans for format strings are cached (keyed by the string) so
+/// `binary.unpack` and `buffer:readstruct` parse each format only once.
+enum binary_opcode { OP_INT, OP_FLOAT, OP_DOUBLE, OP_CHARS, OP_CHARS_PREV, OP_ZSTRING, OP_SKIP };
+
+struct binary_op {
+  uint8_t code;
+  uint8_t le;
+  uint8_t issigned;
+  uint32_t size;
+};
+
+struct binary_plan {
+  size_t nops;
+  size_t size;  // the total size if all operations have a fixed size (0 otherwise)
+  struct binary_op ops[];
+};
+
+char *lua_binary_plan_mt = "<binary.plan>";
+static char *plan_cache = "<binary.plan_cache>";
+static int plan_cache_size = 0;
+#define PLAN_CACHE_MAX 256
+
+static struct binary_plan *compile_plan (lua_State *L, const char *f)
 {
-  int nativele = is_little_endian();
-  int le = nativele;
-  size_t startn = n;
-  int starti = lua_gettop(L);
-  while (1) {
+  size_t nops = 0;
+  for (const char *c = f; *c; c++)
+    if (*c == 'u' || *c == 's' || *c == 'f' || *c == 'c' || *c == 'z' || *c == '_') nops++;
+
+  struct binary_plan *p = luaLM_create_userdata (L, sizeof(struct binary_plan) + nops * sizeof(struct binary_op), lua_binary_plan_mt);
+  int le = is_little_endian();
+  int fixed = 1;
+  size_t i = 0;
+  while (*f) {
     const char *c = f++;
-    if (!*c) {
-      *results = lua_gettop(L) - starti;
-      return startn - n;
-    }
     unsigned size;
     f += scan_uint (f, &size);
     if (f - c <= 1) size = 1;
-    if (n < size) goto tooshort;
+    struct binary_op op = { .le = le, .size = size };
     switch (*c) {
       case 'u':
       case 's':
-        if (size <= 4)
-          lua_pushnumber (L, extract_number (s, size, le, *c == 's'));
-        else
-          lua_pushnumber (L, extract_number_64 (s, size, le, *c == 's'));
-        s += size; n -= size;
+        op.code = OP_INT;
+        op.issigned = *c == 's';
         break;
       case 'f':
-        if(size == 4)
-          lua_pushnumber(L, extract_float (s, le != nativele));
-        else if (size == 8)
-          lua_pushnumber(L, extract_double (s, le != nativele));
-        else
-          return luaL_error(L, "the size of a float must be 4 or 8 bytes");
-        s += size; n -= size;
+        if (size == 4) op.code = OP_FLOAT;
+        else if (size == 8) op.code = OP_DOUBLE;
+        else return luaL_error (L, "the size of a float must be 4 or 8 bytes"), NULL;
         break;
       case 'c':
-        if(size == 0) {
-          if (!lua_isnumber (L, -1)) return luaL_error (L, "a size must come before the c0 format");
-          size = lua_tonumber (L, -1);
-          lua_pop (L, 1);
-        }
+        op.code = size ? OP_CHARS : OP_CHARS_PREV;
+        if (!size) fixed = 0;
+        break;
+      case 'z':
+        op.code = OP_ZSTRING;
+        // the length is found while unpacking, an empty string needs no bytes
+        op.size = 0;
+        fixed = 0;
+        break;
+      case '_': op.code = OP_SKIP; break;
+      case '<': le = 1; continue;
+      case '>': le = 0; continue;
+      default: continue;
+    }
+    p->ops[i++] = op;
+    p->size += size;
+  }
+  p->nops = i;
+  if (!fixed) p->size = 0;
+  return p;
+}
+
+/// Returns the plan for the argument `i` which is either a compiled plan or a format string.
+/// Plans for strings are taken from (or stored into) the cache so they stay alive even though
+/// nothing is left on the stack.
+struct binary_plan *lua_binary_checkplan (lua_State *L, int i)
+{
+  i = abs_index (L, i);
+  if (lua_type (L, i) == LUA_TUSERDATA) return luaL_checkudata (L, i, lua_binary_plan_mt);
+  const char *fmt = luaL_checkstring (L, i);
+  struct binary_plan *p;
+
+  lua_pushlightuserdata (L, &plan_cache);
+  lua_rawget (L, LUA_REGISTRYINDEX);
+  if (lua_isnil (L, -1) || plan_cache_size >= PLAN_CACHE_MAX) {
+    lua_pop (L, 1);
+    lua_newtable (L);
+    lua_pushlightuserdata (L, &plan_cache);
+    lua_pushvalue (L, -2);
+    lua_rawset (L, LUA_REGISTRYINDEX);
+    plan_cache_size = 0;
+  }
+  lua_pushvalue (L, i);
+  lua_rawget (L, -2);
+  p = lua_touserdata (L, -1);
+  lua_pop (L, 1);
+  if (!p) {
+    p = compile_plan (L, fmt);
+    lua_pushvalue (L, i);
+    lua_insert (L, -2);
+    lua_rawset (L, -3);
+    plan_cache_size++;
+  }
+  lua_pop (L, 1);
+  return p;
+}
+
+static inline lua_Number load_int (const uint8_t *s, const struct binary_op *op, int nativele)
+{
+  int flip = op->le != nativele;
+  switch (op->size) {
+    case 1:
+      return op->issigned ? (int8_t)*s : *s;
+    case 2: {
+      uint16_t v; memcpy (&v, s, 2);
+      if (flip) v = (v >> 8) | (v << 8);
+      return op->issigned ? (int16_t)v : v;
+    }
+    case 4: {
+      uint32_t v; memcpy (&v, s, 4);
+      if (flip) v = __builtin_bswap32 (v);
+      return op->issigned ? (lua_Number)(int32_t)v : (lua_Number)v;
+    }
+    case 8: {
+      uint64_t v; memcpy (&v, s, 8);
+      if (flip) v = __builtin_bswap64 (v);
+      return op->issigned ? (lua_Number)(int64_t)v : (lua_Number)v;
+    }
+    default:
+      if (op->size < 4)
+        return extract_number (s, op->size, op->le, op->issigned);
+      else
+        return extract_number_64 (s, op->size, op->le, op->issigned);
+  }
+}
+
+size_t lua_binary_unpack_plan (lua_State *L, const struct binary_plan *p, const uint8_t *s, size_t n, int *results)
+{
+  static int nativele = -1;
+  if (nativele < 0) nativele = is_little_endian();
+  size_t startn = n;
+  int starti = lua_gettop(L);
+  if (n < p->size) goto tooshort;
+  luaL_checkstack (L, p->nops, "too many results to unpack");
+  for (size_t i = 0; i < p->nops; i++) {
+    const struct binary_op *op = &p->ops[i];
+    size_t size = op->size;
+    if (!p->size && n < size) goto tooshort;
+    switch (op->code) {
+      case OP_INT:
+        lua_pushnumber (L, load_int (s, op, nativele));
+        break;
+      case OP_FLOAT:
+        lua_pushnumber (L, extract_float (s, op->le != nativele));
+        break;
+      case OP_DOUBLE:
+        lua_pushnumber (L, extract_double (s, op->le != nativele));
+        break;
+      case OP_CHARS_PREV:
+        if (!lua_isnumber (L, -1) || lua_gettop (L) == starti) return luaL_error (L, "a size must come before the c0 format");
+        size = lua_tonumber (L, -1);
+        lua_pop (L, 1);
         if (n < size) goto tooshort;
+        // fall through
+      case OP_CHARS:
         lua_pushlstring (L, (char *)s, size);
-        s += size; n -= size;
         break;
-      case 'z':
+      case OP_ZSTRING:
         size = byte_findc (s, n, 0);
-        if (n < size) goto tooshort;
         lua_pushlstring (L, (char *)s, size);
-        s += size; n -= size;
         break;
-      case '<': le = 1; break;
-      case '>': le = 0; break;
-      case '_': s += size; n -= size; break;
-      case ' ':
-      case '\r':
-      case '\n':
-      case '\t':
+      case OP_SKIP:
         break;
     }
-    c = f;
+    s += size; n -= size;
   }
+  *results = lua_gettop(L) - starti;
+  return startn - n;
 tooshort:
   lua_pop(L, lua_gettop(L) - starti);
   *results = -1;
   return startn - n;
 }
 
-static int lua_binary_unpack (lua_State *L)
+size_t lua_binary_unpack_ll (lua_State *L, const uint8_t *s, size_t n, const char *f, int *results)
+{
+  lua_pushstring (L, f);
+  struct binary_plan *p = lua_binary_checkplan (L, -1);
+  lua_pop (L, 1);
+  return lua_binary_unpack_plan (L, p, s, n, results);
+}
+
+static int unpack (lua_State *L, int datai, int plani, int offi)
 {
   size_t off = 0, size;
-  const char *s = luaL_checklstring (L, 1, &size);
-  const char *fmt = luaL_checkstring (L, 2);
-  if (lua_isnumber (L, 4)) {
-    size_t end = lua_tonumber (L, 4);
+  const char *s = luaL_checklstring (L, datai, &size);
+  struct binary_plan *p = lua_binary_checkplan (L, plani);
+  if (lua_isnumber (L, offi + 1)) {
+    size_t end = lua_tonumber (L, offi + 1);
     if (end < size) size = end;
   }
-  if (lua_isnumber (L, 3)) {
-    off = lua_tonumber (L, 3) - 1;
+  if (lua_isnumber (L, offi)) {
+    off = lua_tonumber (L, offi) - 1;
     if (off > size) off = size;
   }
   s += off; size -= off;
   int results = 0;
   int results_start = lua_gettop (L);
-  size_t n = lua_binary_unpack_ll (L, (const uint8_t *)s, size, fmt, &results);
+  size_t n = lua_binary_unpack_plan (L, p, (const uint8_t *)s, size, &results);
   lua_pushnumber (L, n); lua_insert (L, results_start + 1);
   return results + 1;
 }
 
+static int lua_binary_unpack (lua_State *L)
+{
+  return unpack (L, 1, 2, 3);
+}
+
+static int lua_binary_compile (lua_State *L)
+{
+  const char *fmt = luaL_checkstring (L, 1);
+  compile_plan (L, fmt);
+  return 1;
+}
+
+/// `plan:unpack(data, off = 1, size = #data)` works like `binary.unpack(data, plan, off, size)`.
+static int lua_binary_plan_unpack (lua_State *L)
+{
+  luaL_checkudata (L, 1, lua_binary_plan_mt);
+  return unpack (L, 2, 1, 3);
+}
+
+/// `plan:size()` returns the number of bytes consumed by the plan (nil for variable sizes).
+static int lua_binary_plan_size (lua_State *L)
+{
+  struct binary_plan *p = luaL_checkudata (L, 1, lua_binary_plan_mt);
+  if (!p->size) return 0;
+  lua_pushnumber (L, p->size);
+  return 1;
+}
+
 // helper functions
 
 static size_t scan_uint (const char *s, unsigned *u)
@@ -183,6 +338,129 @@ static lua_Number extract_double (const uint8_t *s, int flipendian)
   return u.v;
 }
 
+//### unpack_array
+
+/// Decoded arrays are stored as a plain C array of numbers (much more compact than a table).
+struct binary_array {
+  size_t n;
+  lua_Number v[];
+};
+
+char *lua_binary_array_mt = "<binary.array>";
+
+static void decode_array (lua_Number *d, const uint8_t *s, size_t count, const struct binary_op *op)
+{
+  int nativele = is_little_endian();
+  int flip = op->le != nativele;
+  if (op->code == OP_INT && op->size == 2) {
+    // the common case (ADC samples), written so the compiler can vectorize it
+    for (size_t i = 0; i < count; i++, s += 2) {
+      uint16_t v; memcpy (&v, s, 2);
+      if (flip) v = (v >> 8) | (v << 8);
+      d[i] = op->issigned ? (int16_t)v : v;
+    }
+    return;
+  }
+  for (size_t i = 0; i < count; i++, s += op->size) {
+    switch (op->code) {
+      case OP_INT:    d[i] = load_int (s, op, nativele); break;
+      case OP_FLOAT:  d[i] = extract_float (s, flip); break;
+      case OP_DOUBLE: d[i] = extract_double (s, flip); break;
+    }
+  }
+}
+
+/// `binary.unpack_array(data, spec, dst, off = 1)` decodes all consecutive fields of a single
+/// numeric type `spec` (e.g. `'>u2'`) in `data` (starting at `off`). The values are stored in
+/// the `dst` table (which is cleared after the last value), in a new table if `dst` is nil or in
+/// a new compact `binary.array` object if `dst` is `'array'`. Returns the result and the number
+/// of decoded values.
+static int lua_binary_unpack_array (lua_State *L)
+{
+  size_t size;
+  const uint8_t *s = (const uint8_t *)luaL_checklstring (L, 1, &size);
+  struct binary_plan *p = lua_binary_checkplan (L, 2);
+  if (p->nops != 1 || p->ops[0].code > OP_DOUBLE)
+    return luaL_argerror (L, 2, "a single numeric field expected");
+  const struct binary_op *op = &p->ops[0];
+  luaL_argcheck (L, op->size > 0 && op->size <= 8, 2, "invalid field size");
+  size_t off = luaL_optinteger (L, 4, 1) - 1;
+  if (off > size) off = size;
+  s += off;
+  size_t count = (size - off) / op->size;
+
+  if (lua_type (L, 3) == LUA_TSTRING) {
+    if (strcmp (lua_tostring (L, 3), "array")) return luaL_argerror (L, 3, "a table or 'array' expected");
+    struct binary_array *a = luaLM_create_userdata (L, sizeof(struct binary_array) + count * sizeof(lua_Number), lua_binary_array_mt);
+    a->n = count;
+    decode_array (a->v, s, count, op);
+  } else {
+    lua_Number buf[512];
+    if (lua_istable (L, 3)) {
+      lua_pushvalue (L, 3);
+    } else {
+      if (!lua_isnoneornil (L, 3)) return luaL_argerror (L, 3, "a table or 'array' expected");
+      lua_createtable (L, count, 0);
+    }
+    for (size_t done = 0; done < count; ) {
+      size_t n = count - done < 512 ? count - done : 512;
+      decode_array (buf, s + done * op->size, n, op);
+      for (size_t i = 0; i < n; i++) {
+        lua_pushnumber (L, buf[i]);
+        lua_rawseti (L, -2, done + i + 1);
+      }
+      done += n;
+    }
+    for (size_t i = count + 1; ; i++) {
+      lua_rawgeti (L, -1, i);
+      int last = lua_isnil (L, -1);
+      lua_pop (L, 1);
+      if (last) break;
+      lua_pushnil (L);
+      lua_rawseti (L, -2, i);
+    }
+  }
+  lua_pushnumber (L, count);
+  return 2;
+}
+
+static int lua_binary_array_index (lua_State *L)
+{
+  struct binary_array *a = luaL_checkudata (L, 1, lua_binary_array_mt);
+  if (lua_type (L, 2) == LUA_TNUMBER) {
+    lua_Number n = lua_tonumber (L, 2);
+    if (n < 1 || n > a->n) return 0;
+    size_t i = n;
+    lua_pushnumber (L, a->v[i - 1]);
+    return 1;
+  }
+  luaL_getmetatable (L, lua_binary_array_mt);
+  lua_pushvalue (L, 2);
+  lua_rawget (L, -2);
+  return 1;
+}
+
+static int lua_binary_array_len (lua_State *L)
+{
+  struct binary_array *a = luaL_checkudata (L, 1, lua_binary_array_mt);
+  lua_pushnumber (L, a->n);
+  return 1;
+}
+
+/// `array:totable(i = 1, j = #array)` converts a part of the array to a table.
+static int lua_binary_array_totable (lua_State *L)
+{
+  struct binary_array *a = luaL_checkudata (L, 1, lua_binary_array_mt);
+  size_t i = luaL_optinteger (L, 2, 1), j = luaL_optinteger (L, 3, a->n);
+  if (j > a->n) j = a->n;
+  lua_createtable (L, j >= i ? j - i + 1 : 0, 0);
+  for (size_t k = i; k >= 1 && k <= j; k++) {
+    lua_pushnumber (L, a->v[k - 1]);
+    lua_rawseti (L, -2, k - i + 1);
+  }
+  return 1;
+}
+
 //### packfloat
 
 static size_t inject_float (uint8_t *s, int flipendian, lua_Number v);
@@ -341,17 +619,34 @@ static int lua_binary_strxor (lua_State *L)
 //###
 
 static const struct luaL_reg functions[] = {
-  {"unpack",     lua_binary_unpack     },
-  {"unpackbits", lua_binary_unpackbits },
-  {"packfloat",  lua_binary_packfloat  },
-  {"b64_encode", lua_binary_b64_encode },
-  {"b64_decode", lua_binary_b64_decode },
-  {"strxor",     lua_binary_strxor     },
-  {NULL,         NULL                  },
+  {"unpack",        lua_binary_unpack       },
+  {"compile",       lua_binary_compile      },
+  {"unpack_array",  lua_binary_unpack_array },
+  {"unpackbits",    lua_binary_unpackbits   },
+  {"packfloat",     lua_binary_packfloat    },
+  {"b64_encode",    lua_binary_b64_encode   },
+  {"b64_decode",    lua_binary_b64_decode   },
+  {"strxor",        lua_binary_strxor       },
+  {NULL,            NULL                    },
+};
+
+static const struct luaL_reg plan_methods[] = {
+  {"unpack",     lua_binary_plan_unpack },
+  {"size",       lua_binary_plan_size   },
+  {NULL,         NULL                   },
+};
+
+static const struct luaL_reg array_methods[] = {
+  {"totable",    lua_binary_array_totable },
+  {"__index",    lua_binary_array_index   },
+  {"__len",      lua_binary_array_len     },
+  {NULL,         NULL                     },
 };
 
 int luaopen_binary (lua_State *L)
 {
+  luaLM_register_metatable (L, lua_binary_plan_mt, plan_methods);
+  luaLM_register_metatable (L, lua_binary_array_mt, array_methods);
   lua_newtable (L);
   luaL_register (L, NULL, functions);
   return 1;
@@ -1,2 +1,5 @@
+struct binary_plan;
+struct binary_plan *lua_binary_checkplan (lua_State *L, int i);
+size_t lua_binary_unpack_plan (lua_State *L, const struct binary_plan *p, const uint8_t *s, size_t n, int *results);
 size_t lua_binary_unpack_ll (lua_State *L, const uint8_t *s, size_t n, const char *f, int *results);
 int luaopen_binary (lua_State *L);
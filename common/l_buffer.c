@@ -5,6 +5,8 @@
 /// ## Necessary declarations
 #include <unistd.h>
 #include <stdint.h>
+#include <errno.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -17,12 +19,74 @@
 #include "buffer.h"
 #include "l_binary.h"
 
+#define SCAN_TOKEN_MAX 16
+
 struct lua_buffer {
   struct buffer b;
+  size_t scan_tokn; // the token for which b.scan is valid
+  char scan_tok[SCAN_TOKEN_MAX];
 };
 
 char *lua_buffer_mt = "<buffer>";
 
+/// A read-only view into the buffer memory. Slices keep the underlying chunk alive, so they stay
+/// valid after the data is consumed from the buffer (or the buffer itself is collected).
+struct lua_buffer_slice {
+  struct buffer_chunk *chunk;
+  const uint8_t *data;
+  buflen_t len;
+};
+
+char *lua_buffer_slice_mt = "<buffer.slice>";
+
+static void push_slice (lua_State *L, struct buffer_chunk *c, const uint8_t *s, buflen_t len)
+{
+  struct lua_buffer_slice *ls = luaLM_create_userdata (L, sizeof(struct lua_buffer_slice), lua_buffer_slice_mt);
+  ls->chunk = c ? buffer_chunk_ref (c) : NULL;
+  ls->data = s;
+  ls->len = len;
+}
+
+/// Returns the data of the string (or number), the buffer (its unread part) or the buffer slice
+/// at index `i`, or NULL for any other value. For the C functions which accept all of them.
+const char *lua_buffer_tolstring (lua_State *L, int i, size_t *len)
+{
+  int t = lua_type (L, i);
+  if (t == LUA_TSTRING || t == LUA_TNUMBER) return lua_tolstring (L, i, len);
+  if (t != LUA_TUSERDATA || !lua_getmetatable (L, i)) return NULL;
+  luaL_getmetatable (L, lua_buffer_mt);
+  luaL_getmetatable (L, lua_buffer_slice_mt);
+  int buf = lua_rawequal (L, -3, -2), slice = lua_rawequal (L, -3, -1);
+  lua_pop (L, 3);
+  if (buf) {
+    const uint8_t *s;
+    *len = buffer_rpeek (&((struct lua_buffer *)lua_touserdata (L, i))->b, &s);
+    return s ? (const char *)s : "";
+  }
+  if (slice) {
+    struct lua_buffer_slice *ls = lua_touserdata (L, i);
+    *len = ls->len;
+    return ls->len ? (const char *)ls->data : "";
+  }
+  return NULL;
+}
+
+/// Converts Lua style `i`, `j` arguments (1-based, inclusive) to an offset and a length.
+static buflen_t range_arg (lua_State *L, int i, buflen_t size, buflen_t *off)
+{
+  buflen_t end = size;
+  *off = 0;
+  if (lua_isnumber (L, i + 1)) {
+    size_t e = lua_tonumber (L, i + 1);
+    if (e < end) end = e;
+  }
+  if (lua_isnumber (L, i)) {
+    *off = lua_tonumber (L, i) - 1;
+    if (*off > end) *off = end;
+  }
+  return end - *off;
+}
+
 static int lua_buffer_new (lua_State *L)
 {
   struct lua_buffer *lb = luaLM_create_userdata (L, sizeof(struct lua_buffer), lua_buffer_mt);
@@ -33,18 +97,10 @@ static int lua_buffer_new (lua_State *L)
 static int lua_buffer_get (lua_State *L)
 {
   struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
-  buflen_t off = 0;
+  buflen_t off;
   const uint8_t *s;
-  buflen_t size = buffer_rpeek (&lb->b, &s);
-  if (lua_isnumber (L, 3)) {
-    size_t end = lua_tonumber (L, 3);
-    if (end < size) size = end;
-  }
-  if (lua_isnumber (L, 2)) {
-    off = lua_tonumber (L, 2) - 1;
-    if (off > size) off = size;
-  }
-  lua_pushlstring (L, (char *)(s + off), size - off);
+  buflen_t n = range_arg (L, 2, buffer_rpeek (&lb->b, &s), &off);
+  lua_pushlstring (L, (char *)(s + off), n);
   return 1;
 }
 
@@ -98,28 +154,44 @@ static int lua_buffer_readuntil (lua_State *L)
   const char *x = luaL_checklstring (L, 2, &n);
   lua_Integer drop = 0;
   if (lua_isnumber (L, 3)) drop = luaL_checknumber (L, 3);
-  size_t i = byte_find (s, a, x, n);
-  if (i == a) return 0;
+  // continue where the previous unsuccessful search for the same token stopped
+  buflen_t from = 0;
+  if (n && n == lb->scan_tokn && !byte_diff (x, n, lb->scan_tok) && lb->b.scan >= n)
+    from = lb->b.scan - n + 1;
+  size_t i = from + byte_find (s + from, a - from, x, n);
+  if (i == a) {
+    if (n <= SCAN_TOKEN_MAX) {
+      byte_copy (lb->scan_tok, n, x);
+      lb->scan_tokn = n;
+      lb->b.scan = a;
+    }
+    return 0;
+  }
   lua_pushlstring (L, (char *)s, i);
   buffer_rseek (&lb->b, i + drop);
   return 1;
 }
 
-static int lua_buffer_peekstruct (lua_State *L)
+static int peekstruct (lua_State *L, const uint8_t *s, buflen_t a)
 {
-  struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
-  const uint8_t *s;
-  buflen_t a = buffer_rpeek (&lb->b, &s);
-  const char *fmt = luaL_checkstring (L, 2);
+  struct binary_plan *p = lua_binary_checkplan (L, 2);
   int results = 0;
   lua_pushnil (L);
   int starti = lua_gettop(L);
-  size_t n = lua_binary_unpack_ll (L, s, a, fmt, &results);
+  size_t n = lua_binary_unpack_plan (L, p, s, a, &results);
   if (results < 0) return 0;
   lua_pushnumber (L, n); lua_replace (L, starti);
   return results + 1;
 }
 
+static int lua_buffer_peekstruct (lua_State *L)
+{
+  struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
+  const uint8_t *s;
+  buflen_t a = buffer_rpeek (&lb->b, &s);
+  return peekstruct (L, s, a);
+}
+
 static int lua_buffer_readstruct (lua_State *L)
 {
   struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
@@ -159,6 +231,124 @@ static int lua_buffer_debug (lua_State *L)
   return 1;
 }
 
+/// `buffer:slice([i [, j]])` returns a view of the unread data (like `get` but without copying).
+static int lua_buffer_slice (lua_State *L)
+{
+  struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
+  buflen_t off;
+  const uint8_t *s;
+  buflen_t n = range_arg (L, 2, buffer_rpeek (&lb->b, &s), &off);
+  push_slice (L, lb->b.chunk, s + off, n);
+  return 1;
+}
+
+/// `buffer:readslice([n])` consumes `n` bytes (or everything) and returns them as a slice.
+static int lua_buffer_readslice (lua_State *L)
+{
+  struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
+  const uint8_t *s;
+  buflen_t a = buffer_rpeek (&lb->b, &s);
+  if (!a) return 0;
+  if (!lua_isnoneornil (L, 2)) {
+    buflen_t n = luaL_checkinteger (L, 2);
+    if (a < n) return 0;
+    a = n;
+  }
+  push_slice (L, lb->b.chunk, s, a);
+  buffer_rseek (&lb->b, a);
+  return 1;
+}
+
+/// `buffer:fill(fd [, n])` reads up to `n` bytes (100 KiB by default) from a file descriptor
+/// straight into the free space of the buffer (which is grown to have room for `n` bytes first).
+/// Returns the number of bytes read (0 if a non-blocking descriptor has no data yet),
+/// `nil, "eof"` or `nil, error message`.
+static int lua_buffer_fill (lua_State *L)
+{
+  struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
+  int fd = luaLM_checkfd (L, 2);
+  lua_Integer n = luaL_optinteger (L, 3, 100*1024);
+  luaL_argcheck (L, n > 0, 3, "the read size must be positive");
+  uint8_t *d;
+  if (!buffer_ensure (&lb->b, n)) return luaL_error (L, "cannot allocate memory for the buffer");
+  buflen_t space = buffer_wpeek (&lb->b, &d);
+  if (space > (buflen_t)n) space = n;
+  ssize_t ret = read (fd, d, space);
+  if (!ret) { // EOF
+    lua_pushnil (L);
+    lua_pushliteral (L, "eof");
+    return 2;
+  }
+  if (ret < 0) { // error
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      lua_pushnumber (L, 0);
+      return 1;
+    }
+    const char *msg = strerror (errno);
+    lua_pushnil (L);
+    lua_pushstring (L, msg);
+    return 2;
+  }
+  buffer_wseek (&lb->b, ret);
+  lua_pushnumber (L, ret);
+  return 1;
+}
+
+/// `buffer:release()` frees the buffer memory right away (slices stay valid).
+static int lua_buffer_release (lua_State *L)
+{
+  struct lua_buffer *lb = luaL_checkudata (L, 1, lua_buffer_mt);
+  buffer_release (&lb->b);
+  return 0;
+}
+
+//### slices
+
+static int lua_buffer_slice_get (lua_State *L)
+{
+  struct lua_buffer_slice *ls = luaL_checkudata (L, 1, lua_buffer_slice_mt);
+  buflen_t off;
+  buflen_t n = range_arg (L, 2, ls->len, &off);
+  lua_pushlstring (L, (char *)(ls->data + off), n);
+  return 1;
+}
+
+static int lua_buffer_slice_sub (lua_State *L)
+{
+  struct lua_buffer_slice *ls = luaL_checkudata (L, 1, lua_buffer_slice_mt);
+  buflen_t off;
+  buflen_t n = range_arg (L, 2, ls->len, &off);
+  push_slice (L, ls->chunk, ls->data + off, n);
+  return 1;
+}
+
+/// `slice:peekstruct(format [, i])` works like `buffer:peekstruct` starting at byte `i`.
+static int lua_buffer_slice_peekstruct (lua_State *L)
+{
+  struct lua_buffer_slice *ls = luaL_checkudata (L, 1, lua_buffer_slice_mt);
+  buflen_t off = luaL_optinteger (L, 3, 1) - 1;
+  if (off > ls->len) off = ls->len;
+  lua_settop (L, 2);
+  return peekstruct (L, ls->data + off, ls->len - off);
+}
+
+static int lua_buffer_slice_len (lua_State *L)
+{
+  struct lua_buffer_slice *ls = luaL_checkudata (L, 1, lua_buffer_slice_mt);
+  lua_pushnumber (L, ls->len);
+  return 1;
+}
+
+static int lua_buffer_slice_gc (lua_State *L)
+{
+  struct lua_buffer_slice *ls = luaL_checkudata (L, 1, lua_buffer_slice_mt);
+  buffer_chunk_unref (ls->chunk);
+  ls->chunk = NULL;
+  ls->data = NULL;
+  ls->len = 0;
+  return 0;
+}
+
 static const struct luaL_reg functions[] = {
   {"new",  lua_buffer_new },
   {NULL,   NULL           },
@@ -173,14 +363,29 @@ static const struct luaL_reg buffer_methods[] = {
   {"peekstruct", lua_buffer_peekstruct },
   {"readstruct", lua_buffer_readstruct },
   {"rseek",      lua_buffer_rseek      },
+  {"slice",      lua_buffer_slice      },
+  {"readslice",  lua_buffer_readslice  },
+  {"fill",       lua_buffer_fill       },
+  {"release",    lua_buffer_release    },
   {"_debug",     lua_buffer_debug      },
   {"__len",      lua_buffer_len        },
+  {"__gc",       lua_buffer_release    },
   {NULL,         NULL                  },
 };
 
+static const struct luaL_reg slice_methods[] = {
+  {"get",        lua_buffer_slice_get        },
+  {"sub",        lua_buffer_slice_sub        },
+  {"peekstruct", lua_buffer_slice_peekstruct },
+  {"__len",      lua_buffer_slice_len        },
+  {"__gc",       lua_buffer_slice_gc         },
+  {NULL,         NULL                        },
+};
+
 int luaopen_buffer (lua_State *L)
 {
   luaLM_register_metatable (L, lua_buffer_mt, buffer_methods);
+  luaLM_register_metatable (L, lua_buffer_slice_mt, slice_methods);
   lua_newtable (L);
   luaL_register (L, NULL, functions);
   return 1;
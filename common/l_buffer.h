@@ -1,2 +1,3 @@
 extern char *lua_buffer_mt;
+const char *lua_buffer_tolstring (lua_State *L, int i, size_t *len);
 int luaopen_buffer (lua_State *L);
@@ -110,6 +110,13 @@ static int lua_miniz_compressor__tostring (lua_State *L)
   return 1;
 }
 
+static int lua_miniz_compressor__gc (lua_State *L)
+{
+  struct lua_miniz_compressor *lc = luaL_checkudata (L, 1, lua_miniz_compressor_mt);
+  buffer_release (&lc->bout);
+  return 0;
+}
+
 
 
 
@@ -225,6 +232,14 @@ static int lua_miniz_decompressor__tostring (lua_State *L)
   return 1;
 }
 
+static int lua_miniz_decompressor__gc (lua_State *L)
+{
+  struct lua_miniz_decompressor *ld = luaL_checkudata (L, 1, lua_miniz_decompressor_mt);
+  buffer_release (&ld->bin);
+  buffer_release (&ld->bout);
+  return 0;
+}
+
 
 
 static const struct luaL_reg funcs[] = {
@@ -239,6 +254,7 @@ static const struct luaL_reg miniz_compressor_methods[] = {
   {"__len",      lua_miniz_compressor__len      },
   {"read",       lua_miniz_compressor_read      },
   {"__tostring", lua_miniz_compressor__tostring },
+  {"__gc",       lua_miniz_compressor__gc       },
   {NULL,         NULL                           },
 };
 
@@ -248,6 +264,7 @@ static const struct luaL_reg miniz_decompressor_methods[] = {
   {"read",       lua_miniz_decompressor_read      },
   {"adler32",    lua_miniz_decompressor_adler32   },
   {"__tostring", lua_miniz_decompressor__tostring },
+  {"__gc",       lua_miniz_decompressor__gc       },
   {NULL,         NULL                             },
 };
 
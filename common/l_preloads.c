@@ -15,6 +15,8 @@
 #include "l_buffer.h"
 #include "l_sha.h"
 #include "l_miniz.h"
+#include "l_timers.h"
+#include "l_sepack.h"
 int luaopen_bit32(lua_State *L);
 int luaopen_socket_core(lua_State *L);
 int luaopen_mime_core(lua_State *L);
@@ -39,6 +41,8 @@ const struct luaL_reg preloads[] = {
   { "sha",            luaopen_sha           },
   { "ev",             luaopen_ev            },
   { "miniz",          luaopen_miniz         },
+  { "timers",         luaopen_timers        },
+  { "_sepack",        luaopen_sepack        },
   { "lpeg",           luaopen_lpeg          },
   { "cjson",          luaopen_cjson         },
   { "cjson.safe",     luaopen_cjson_safe    },
@@ -0,0 +1,176 @@
+///
+/// The sepack USB framing in C.
+///
+/// Every sepack USB transfer consists of frames of up to 62 bytes of channel data. Each frame
+/// starts with a header byte (the channel id in the low nibble, a "more fragments follow" bit
+/// and three flag bits) followed by a length byte (unless the transport uses implicit lengths,
+/// i.e. one frame per transfer).
+///
+
+/// ## Necessary declarations
+#include <stdint.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "debug.h"
+#include "LM.h"
+#include "l_sepack.h"
+
+#define SEPACK_MAX_PAYLOAD 62
+#define SEPACK_MORE_BIT 0x10
+
+//### demux
+
+/// `_sepack.demux(transfer, implicit_length, out)` splits a received transfer into frames and
+/// stores them in the `out` table as consecutive `id, data, flags, final` quadruples. Adjacent
+/// fragments of the same channel (with the same flags) are merged into one entry. Returns the
+/// number of stored entries (`out` is reused, entries after the last one are left untouched).
+static int lua_sepack_demux (lua_State *L)
+{
+  size_t n;
+  const uint8_t *p = (const uint8_t *)luaL_checklstring (L, 1, &n);
+  int implicit_length = lua_toboolean (L, 2);
+  luaL_checktype (L, 3, LUA_TTABLE);
+
+  luaL_Buffer b;
+  int count = 0;
+  int open = 0; // a merged entry is being collected in b
+  int cur_id = -1, cur_flags = -1;
+  size_t i = 0;
+  while (i < n) {
+    uint8_t head = p[i];
+    int id = head & 0x0f;
+    int final = !(head & SEPACK_MORE_BIT);
+    int flags = head >> 5;
+    size_t len, off;
+    if (implicit_length) {
+      off = i + 1;
+      len = n - off;
+    } else {
+      off = i + 2;
+      len = i + 1 < n ? p[i + 1] : 0;
+      if (off > n) off = n;
+      if (len > n - off) len = n - off;
+    }
+    i = off + len;
+
+    if (open && (id != cur_id || flags != cur_flags)) {
+      // the previous channel did not finish its data in this transfer
+      luaL_pushresult (&b);
+      lua_rawseti (L, 3, count * 4 + 2);
+      lua_pushboolean (L, 0);
+      lua_rawseti (L, 3, count * 4 + 4);
+      count++;
+      open = 0;
+    }
+    if (!open) {
+      cur_id = id;
+      cur_flags = flags;
+      lua_pushnumber (L, id);
+      lua_rawseti (L, 3, count * 4 + 1);
+      lua_pushnumber (L, flags);
+      lua_rawseti (L, 3, count * 4 + 3);
+      if (final) {
+        lua_pushlstring (L, (const char *)p + off, len);
+        lua_rawseti (L, 3, count * 4 + 2);
+        lua_pushboolean (L, 1);
+        lua_rawseti (L, 3, count * 4 + 4);
+        count++;
+        continue;
+      }
+      luaL_buffinit (L, &b);
+      open = 1;
+    }
+    luaL_addlstring (&b, (const char *)p + off, len);
+    if (final) {
+      luaL_pushresult (&b);
+      lua_rawseti (L, 3, count * 4 + 2);
+      lua_pushboolean (L, 1);
+      lua_rawseti (L, 3, count * 4 + 4);
+      count++;
+      open = 0;
+    }
+  }
+  if (open) {
+    luaL_pushresult (&b);
+    lua_rawseti (L, 3, count * 4 + 2);
+    lua_pushboolean (L, 0);
+    lua_rawseti (L, 3, count * 4 + 4);
+    count++;
+  }
+  lua_pushnumber (L, count);
+  return 1;
+}
+
+//### framing
+
+static uint8_t check_header (lua_State *L)
+{
+  lua_Integer id = luaL_checkinteger (L, 1);
+  lua_Integer flags = luaL_optinteger (L, 3, 0);
+  luaL_argcheck (L, id >= 0 && id <= 0x0f, 1, "invalid channel id");
+  luaL_argcheck (L, flags >= 0 && flags <= 7, 3, "invalid flags");
+  return id | (flags << 5);
+}
+
+/// `_sepack.frame(id, data, flags = 0)` fragments `data` into frames with explicit lengths and
+/// returns all of them in one string (to be sent as a single transfer).
+static int lua_sepack_frame (lua_State *L)
+{
+  size_t n;
+  const char *s = luaL_checklstring (L, 2, &n);
+  uint8_t head = check_header (L);
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  do {
+    size_t len = n > SEPACK_MAX_PAYLOAD ? SEPACK_MAX_PAYLOAD : n;
+    luaL_addchar (&b, head | (len == n ? 0 : SEPACK_MORE_BIT));
+    luaL_addchar (&b, len);
+    luaL_addlstring (&b, s, len);
+    s += len; n -= len;
+  } while (n);
+  luaL_pushresult (&b);
+  return 1;
+}
+
+/// `_sepack.frames(id, data, flags, out)` fragments `data` into frames with implicit lengths
+/// (one per transfer), stores them in `out[1..n]` and returns `n`.
+static int lua_sepack_frames (lua_State *L)
+{
+  size_t n;
+  const char *s = luaL_checklstring (L, 2, &n);
+  uint8_t head = check_header (L);
+  luaL_checktype (L, 4, LUA_TTABLE);
+  char frame[SEPACK_MAX_PAYLOAD + 1];
+  int count = 0;
+  do {
+    size_t len = n > SEPACK_MAX_PAYLOAD ? SEPACK_MAX_PAYLOAD : n;
+    frame[0] = head | (len == n ? 0 : SEPACK_MORE_BIT);
+    memcpy (frame + 1, s, len);
+    lua_pushlstring (L, frame, len + 1);
+    lua_rawseti (L, 4, ++count);
+    s += len; n -= len;
+  } while (n);
+  lua_pushnumber (L, count);
+  return 1;
+}
+
+//###
+
+static const struct luaL_reg functions[] = {
+  {"demux",      lua_sepack_demux      },
+  {"frame",      lua_sepack_frame      },
+  {"frames",     lua_sepack_frames     },
+  {NULL,         NULL                  },
+};
+
+int luaopen_sepack (lua_State *L)
+{
+  lua_newtable (L);
+  luaL_register (L, NULL, functions);
+  lua_pushnumber (L, SEPACK_MAX_PAYLOAD);
+  lua_setfield (L, -2, "MAX_PAYLOAD");
+  return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef L_SEPACK_H
+#define L_SEPACK_H
+
+int luaopen_sepack(lua_State *L);
+
+#endif
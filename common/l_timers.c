@@ -0,0 +1,404 @@
+///
+/// Pooled and coalesced one-shot timers for the default libev loop.
+///
+/// `Thread.sleep` and `Thread.Timeout` create lots of short lived timers. Instead of allocating
+/// a fresh `ev.Timer` userdata (with a few closures) for each of them, this module keeps a pool of
+/// timer entries and groups all entries expiring in the same tick under a single `ev_timer`.
+/// Entries are identified by numeric ids (a slot index and a generation counter), so cancelling
+/// or restarting a timer is O(1) and does not create any garbage.
+///
+/// All expired entries are passed (one by one) to a single Lua `dispatch` function given to
+/// `timers.new`, the errors it raises to the `on_error` function given there.
+///
+
+/// ## Necessary declarations
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <ev.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "debug.h"
+#include "LM.h"
+#include "l_timers.h"
+
+#define TIMERS_HASH_SIZE 256 // has to be a power of 2
+#define TIMERS_SLOT_BITS 24
+#define TIMERS_SLOT_MASK ((1 << TIMERS_SLOT_BITS) - 1)
+#define TIMERS_GEN_MASK  ((1 << 28) - 1)
+
+struct timer_bucket;
+
+struct timer_entry {
+  struct timer_bucket *bucket; // NULL for free entries
+  int prev, next;              // the bucket list (or the free list)
+  uint32_t gen;
+};
+
+struct timer_bucket {
+  ev_timer w;                  // has to be the first field
+  struct timers *t;
+  int64_t tick;
+  int head, tail;
+  int firing;
+  struct timer_bucket *hnext;  // the hash chain (or the free list)
+};
+
+struct timers {
+  lua_State *L;
+  double tick;
+  struct timer_entry *entries;
+  int size, free, active;
+  int nbuckets;
+  struct timer_bucket *hash[TIMERS_HASH_SIZE];
+  struct timer_bucket *free_buckets;
+};
+
+char *timers_mt = "<timers>";
+
+//### entries
+
+static int entry_alloc (struct timers *t)
+{
+  if (t->free < 0) {
+    int size = t->size ? t->size * 2 : 64;
+    if (size > TIMERS_SLOT_MASK + 1) return -1;
+    struct timer_entry *entries = realloc (t->entries, size * sizeof(struct timer_entry));
+    if (!entries) return -1;
+    for (int i = t->size; i < size; i++)
+      entries[i] = (struct timer_entry){ .bucket = NULL, .next = i + 1 < size ? i + 1 : -1 };
+    t->entries = entries;
+    t->free = t->size;
+    t->size = size;
+  }
+  int i = t->free;
+  t->free = t->entries[i].next;
+  t->active++;
+  return i;
+}
+
+static void entry_free (struct timers *t, int i)
+{
+  struct timer_entry *e = &t->entries[i];
+  e->bucket = NULL;
+  e->gen = (e->gen + 1) & TIMERS_GEN_MASK;
+  e->next = t->free;
+  t->free = i;
+  t->active--;
+}
+
+static inline lua_Number entry_id (struct timers *t, int i)
+{
+  return (lua_Number)t->entries[i].gen * (TIMERS_SLOT_MASK + 1) + i;
+}
+
+/// Returns the slot index for a valid id of a pending timer (or -1).
+static int entry_find (struct timers *t, lua_Number id)
+{
+  if (id < 0) return -1;
+  uint64_t n = id;
+  int i = n & TIMERS_SLOT_MASK;
+  if (i >= t->size) return -1;
+  struct timer_entry *e = &t->entries[i];
+  if (!e->bucket || e->gen != (n >> TIMERS_SLOT_BITS)) return -1;
+  return i;
+}
+
+//### buckets
+
+static void bucket_cb (EV_P_ ev_timer *w, int revents);
+
+static struct timer_bucket **bucket_slot (struct timers *t, int64_t tick)
+{
+  struct timer_bucket **p = &t->hash[tick & (TIMERS_HASH_SIZE - 1)];
+  while (*p && (*p)->tick != tick) p = &(*p)->hnext;
+  return p;
+}
+
+static struct timer_bucket *bucket_get (struct timers *t, int64_t tick)
+{
+  struct timer_bucket **p = bucket_slot (t, tick);
+  if (*p) return *p;
+
+  struct timer_bucket *b = t->free_buckets;
+  if (b) {
+    t->free_buckets = b->hnext;
+  } else {
+    b = malloc (sizeof(struct timer_bucket));
+    if (!b) return NULL;
+    t->nbuckets++;
+  }
+  *b = (struct timer_bucket){ .t = t, .tick = tick, .head = -1, .tail = -1 };
+  *p = b;
+
+  double delay = tick * t->tick - ev_now (EV_DEFAULT);
+  ev_timer_init (&b->w, bucket_cb, delay > 0 ? delay : 0, 0);
+  ev_timer_start (EV_DEFAULT, &b->w);
+  return b;
+}
+
+static void bucket_release (struct timers *t, struct timer_bucket *b)
+{
+  if (!b->firing) {
+    ev_timer_stop (EV_DEFAULT, &b->w);
+    struct timer_bucket **p = bucket_slot (t, b->tick);
+    if (*p == b) *p = b->hnext;
+  }
+  b->hnext = t->free_buckets;
+  t->free_buckets = b;
+}
+
+static void bucket_link (struct timers *t, struct timer_bucket *b, int i)
+{
+  struct timer_entry *e = &t->entries[i];
+  e->bucket = b;
+  e->prev = b->tail;
+  e->next = -1;
+  if (b->tail >= 0) t->entries[b->tail].next = i;
+  else b->head = i;
+  b->tail = i;
+}
+
+/// Removes the entry from its bucket. Releases the bucket when it becomes empty (unless it is
+/// being dispatched at the moment).
+static void bucket_unlink (struct timers *t, int i)
+{
+  struct timer_entry *e = &t->entries[i];
+  struct timer_bucket *b = e->bucket;
+  if (e->prev >= 0) t->entries[e->prev].next = e->next;
+  else b->head = e->next;
+  if (e->next >= 0) t->entries[e->next].prev = e->prev;
+  else b->tail = e->prev;
+  e->bucket = NULL;
+  if (b->head < 0 && !b->firing) bucket_release (t, b);
+}
+
+static int64_t expiry_tick (struct timers *t, double seconds)
+{
+  return ceil ((ev_now (EV_DEFAULT) + seconds) / t->tick);
+}
+
+static int traceback (lua_State *L)
+{
+    if (!lua_isstring(L, 1)) return 1;
+    lua_getglobal(L, "debug");
+    if (!lua_istable(L, -1)) { lua_pop(L, 1); return 1; }
+
+    lua_getfield(L, -1, "traceback");
+    if (!lua_isfunction(L, -1)) { lua_pop(L, 2); return 1; }
+
+    lua_pushvalue(L, 1);    /* pass error message */
+    lua_pushinteger(L, 2);  /* skip this function in traceback */
+    lua_call(L, 2, 1);      /* call debug.traceback */
+    return 1;
+}
+
+/// Passes the error message on top of the stack to `on_error` (and pops it). Exits if there is
+/// no handler or if the handler fails as well.
+static void report_error (lua_State *L, int env)
+{
+  lua_getfield (L, env, "on_error");
+  if (!lua_isnil (L, -1)) {
+    lua_insert (L, -2);
+    if (!lua_pcall (L, 1, 0, 0)) return;
+  } else {
+    lua_pop (L, 1);
+  }
+  eprintf ("timer callback error: %s\n", lua_tostring (L, -1));
+  exit(4);
+}
+
+/// Dispatches all entries of an expired bucket. The bucket is removed from the hash first so
+/// timers added by the callbacks always go into new buckets.
+static void bucket_cb (EV_P_ ev_timer *w, int revents)
+{
+  struct timer_bucket *b = (struct timer_bucket *)w;
+  struct timers *t = b->t;
+  lua_State *L = t->L;
+  STACK_CHECK;
+
+  // the bucket stays in the hash, where the pending `__gc` of the timers frees it
+  if (!luaLM_push_proxy (L, t)) {
+    _D("timers object was garbage collected with pending timers");
+    return;
+  }
+  struct timer_bucket **p = bucket_slot (t, b->tick);
+  if (*p == b) *p = b->hnext;
+  b->firing = 1;
+
+  lua_pushcfunction (L, traceback);
+  lua_getfenv (L, -2);
+  // timers = -3, traceback = -2, env = -1
+  while (b->head >= 0) {
+    int i = b->head;
+    bucket_unlink (t, i);
+    entry_free (t, i);
+    lua_getfield (L, -1, "dispatch");
+    lua_rawgeti (L, -2, i + 1);
+    lua_pushnil (L);
+    lua_rawseti (L, -4, i + 1);
+    if (lua_pcall (L, 1, 0, -4)) report_error (L, lua_gettop (L) - 1);
+  }
+  lua_pop (L, 3); // env, traceback, timers
+
+  b->firing = 0;
+  b->hnext = t->free_buckets;
+  t->free_buckets = b;
+  STACK_CHECK_END;
+}
+
+//### Lua API
+
+/// `timers.new(tick, dispatch, on_error)` creates a new timer pool. Expiry times are rounded up
+/// to multiples of `tick` seconds. Errors raised by `dispatch` are passed to `on_error` (with a
+/// traceback), without it they end the process.
+static int timers_new (lua_State *L)
+{
+  double tick = luaL_checknumber (L, 1);
+  luaL_argcheck (L, tick > 0, 1, "the tick has to be positive");
+  luaL_checktype (L, 2, LUA_TFUNCTION);
+  if (!lua_isnoneornil (L, 3)) luaL_checktype (L, 3, LUA_TFUNCTION);
+
+  struct timers *t = luaLM_create_userdata (L, sizeof(struct timers), timers_mt);
+  t->L = luaLM_get_main_state (L);
+  t->tick = tick;
+  t->free = -1;
+
+  lua_createtable (L, 64, 2);
+  lua_pushvalue (L, 2);
+  lua_setfield (L, -2, "dispatch");
+  lua_pushvalue (L, 3);
+  lua_setfield (L, -2, "on_error");
+  lua_setfenv (L, -2);
+  return 1;
+}
+
+/// `timers:add(seconds, object)` schedules `dispatch(object)` and returns the timer id.
+static int timers_add (lua_State *L)
+{
+  struct timers *t = luaL_checkudata (L, 1, timers_mt);
+  double seconds = luaL_checknumber (L, 2);
+  luaL_checkany (L, 3);
+  luaL_argcheck (L, !lua_isnil (L, 3), 3, "object expected");
+
+  int i = entry_alloc (t);
+  if (i < 0) return luaL_error (L, "cannot allocate a timer");
+  struct timer_bucket *b = bucket_get (t, expiry_tick (t, seconds));
+  if (!b) {
+    entry_free (t, i);
+    return luaL_error (L, "cannot allocate a timer");
+  }
+  bucket_link (t, b, i);
+
+  lua_getfenv (L, 1);
+  lua_pushvalue (L, 3);
+  lua_rawseti (L, -2, i + 1);
+  lua_pop (L, 1);
+
+  lua_pushnumber (L, entry_id (t, i));
+  return 1;
+}
+
+/// `timers:cancel(id)` returns true if the timer was still pending.
+static int timers_cancel (lua_State *L)
+{
+  struct timers *t = luaL_checkudata (L, 1, timers_mt);
+  int i = entry_find (t, luaL_checknumber (L, 2));
+  if (i < 0) {
+    lua_pushboolean (L, 0);
+    return 1;
+  }
+  bucket_unlink (t, i);
+  entry_free (t, i);
+
+  lua_getfenv (L, 1);
+  lua_pushnil (L);
+  lua_rawseti (L, -2, i + 1);
+  lua_pop (L, 1);
+
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+/// `timers:restart(id, seconds)` moves a pending timer to a new expiry time (keeping its id).
+/// Returns false (and does nothing) if the timer already expired or was cancelled.
+static int timers_restart (lua_State *L)
+{
+  struct timers *t = luaL_checkudata (L, 1, timers_mt);
+  int i = entry_find (t, luaL_checknumber (L, 2));
+  double seconds = luaL_checknumber (L, 3);
+  if (i < 0) {
+    lua_pushboolean (L, 0);
+    return 1;
+  }
+  int64_t tick = expiry_tick (t, seconds);
+  if (t->entries[i].bucket->tick != tick || t->entries[i].bucket->firing) {
+    bucket_unlink (t, i);
+    struct timer_bucket *b = bucket_get (t, tick);
+    if (!b) return luaL_error (L, "cannot allocate a timer");
+    bucket_link (t, b, i);
+  }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+/// `timers:stats()` returns the number of pending timers, the number of allocated timer entries
+/// and the number of allocated `ev_timer` buckets.
+static int timers_stats (lua_State *L)
+{
+  struct timers *t = luaL_checkudata (L, 1, timers_mt);
+  lua_pushnumber (L, t->active);
+  lua_pushnumber (L, t->size);
+  lua_pushnumber (L, t->nbuckets);
+  return 3;
+}
+
+static int timers_gc (lua_State *L)
+{
+  struct timers *t = luaL_checkudata (L, 1, timers_mt);
+  for (int h = 0; h < TIMERS_HASH_SIZE; h++) {
+    struct timer_bucket *b = t->hash[h];
+    while (b) {
+      struct timer_bucket *next = b->hnext;
+      ev_timer_stop (EV_DEFAULT, &b->w);
+      free (b);
+      b = next;
+    }
+    t->hash[h] = NULL;
+  }
+  while (t->free_buckets) {
+    struct timer_bucket *next = t->free_buckets->hnext;
+    free (t->free_buckets);
+    t->free_buckets = next;
+  }
+  free (t->entries);
+  t->entries = NULL;
+  t->size = t->active = t->nbuckets = 0;
+  t->free = -1;
+  return 0;
+}
+
+static const struct luaL_reg functions[] = {
+  {"new",  timers_new },
+  {NULL,   NULL       },
+};
+
+static const struct luaL_reg timers_methods[] = {
+  {"add",     timers_add     },
+  {"cancel",  timers_cancel  },
+  {"restart", timers_restart },
+  {"stats",   timers_stats   },
+  {"__gc",    timers_gc      },
+  {NULL,      NULL           },
+};
+
+int luaopen_timers (lua_State *L)
+{
+  luaLM_register_metatable (L, timers_mt, timers_methods);
+  lua_newtable (L);
+  luaL_register (L, NULL, functions);
+  return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef L_TIMERS_H
+#define L_TIMERS_H
+
+int luaopen_timers(lua_State *L);
+
+#endif
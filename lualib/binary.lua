@@ -96,6 +96,30 @@ M.enc64LE = M.binary_encoder(8, true)
 --  8 260 "abcd  "
 --$ binary.unpack('\4\1abcd\0 ', '< u2 z')
 --  6 260 "abcd"
+
+--. `binary.compile(spec)` parses `spec` once and returns a plan which can be
+--. used instead of the `spec` string in `binary.unpack` and `buffer:readstruct`.
+--. Format strings are compiled and cached on first use anyway, a plan only
+--. saves the cache lookup. `plan:size()` returns the number of bytes consumed
+--. by fixed size plans.
+
+--$ header = binary.compile'> u2 s2'
+--$ header:unpack(data, 3)
+--  4 0 384
+--$ header:size()
+--  4
+
+--. `binary.unpack_array(data, spec, dst, off = 1)` decodes all consecutive
+--. values of a single numeric `spec` at once. They are stored in the `dst`
+--. table, a new table (when `dst` is `nil`) or a compact `binary.array`
+--. object (when `dst` is `'array'`). Returns the result and the number of
+--. decoded values.
+
+--$ binary.unpack_array('\0\1\0\2\255\255', '>u2')
+--  { 1, 2, 65535 } 3
+--$ a = binary.unpack_array('\0\1\0\2\255\255', '>s2', 'array')
+--$ #a, a[1], a[3], a:totable(2)
+--  3 1 -1 { 2, -1 }
 --@ ../common/l_binary.c:unpack
 
 
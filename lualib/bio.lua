@@ -9,11 +9,16 @@ local IBuf = Object:inherit()
 function IBuf.init (self, file)
   self.file = file
   self.buffer = buffer.new()
+  -- descriptors are read straight into the buffer where the loop supports
+  -- it, LuaSocket objects keep using `receive` (which may have data in its
+  -- own buffer already)
+  self.fill = loop.fill and type(file) == 'number'
 end
 
 function IBuf._read (self, reader)
   local data = reader ()
   if data ~= nil then return data end
+  if self.fill then return self:_fill(reader) end
   while true do
     local data, err = loop.read (self.file)
     if err and err ~= "eof" then
@@ -31,6 +36,15 @@ function IBuf._read (self, reader)
   end
 end
 
+function IBuf._fill (self, reader)
+  while true do
+    local n, err = loop.fill (self.file, self.buffer)
+    if not n then return nil, err end
+    local ret = reader ()
+    if ret then return ret end
+  end
+end
+
 function IBuf.read (self, len)
   return self:_read (function () return self.buffer:read(len) end)
 end
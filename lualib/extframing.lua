@@ -0,0 +1,74 @@
+local B = require'binary'
+
+-- Binary framing of the messages exchanged between ExtProc and its external
+-- process (see `raw-usb.lua`). Both sides start with the line based text
+-- protocol and switch each direction to binary framing after the "binary"
+-- line. Every binary message starts with an 8 byte little-endian header:
+-- payload length (u4), message type (u1), stream (u1) and a sequence number
+-- (u2) counting the messages sent in this direction. The stream is 0 except
+-- on connections multiplexing several devices (see `usb-broker.lua`).
+local M = {
+  DATA = 1,
+  COMMAND = 2,
+  HEADER_SIZE = 8,
+}
+
+local header = B.compile'< u4 u1 u1 u2'
+local schar = string.char
+local floor = math.floor
+
+local function encode_header (kind, seq, len, stream)
+  return schar(len % 256, floor(len / 256) % 256, floor(len / 65536) % 256, floor(len / 16777216),
+               kind, stream or 0, seq % 256, floor(seq / 256))
+end
+
+local function encode (kind, seq, data, stream)
+  return encode_header(kind, seq, #data, stream)..data
+end
+M.encode = encode
+
+-- Returns a function encoding the consecutive messages of one direction.
+-- With `split` it returns the header and the payload separately (to be
+-- written with `loop.writev` without copying the payload).
+function M.writer ()
+  local seq = -1
+  return function (kind, data, stream, split)
+    seq = (seq + 1) % 65536
+    if split then return encode_header(kind, seq, #data, stream), data end
+    return encode(kind, seq, data, stream)
+  end
+end
+
+-- Returns a function reading the consecutive messages from the `bio.IBuf`
+-- `b`. Same as `ExtProc.read_message` it returns either the payload of a data
+-- message, `nil` and the text of a command, or `nil, nil` and an error. The
+-- stream of the message is returned as the fourth value.
+function M.reader (b)
+  local seq = 0
+  return function ()
+    local h, err = b:read(M.HEADER_SIZE)
+    if not h then
+      if err == 'closed' then err = 'eof' end
+      return nil, nil, err
+    end
+    local _, len, kind, stream, s = header:unpack(h)
+    if s ~= seq then
+      return nil, nil, string.format('framing error: sequence number %d, expected %d', s, seq)
+    end
+    seq = (seq + 1) % 65536
+    local data = ''
+    if len > 0 then
+      data, err = b:read(len)
+      if not data then return nil, nil, err end
+    end
+    if kind == M.DATA then
+      return data, nil, nil, stream
+    elseif kind == M.COMMAND then
+      return nil, data, nil, stream
+    else
+      return nil, nil, 'framing error: unknown message type '..kind
+    end
+  end
+end
+
+return M
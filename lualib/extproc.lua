@@ -6,63 +6,117 @@ local B = require'binary'
 local D = require'util'
 local Object = require'oo'
 local o = require'kvo'
+local F = require'extframing'
 
 local ExtProc = Object:inherit{
   respawn_period = 1,
-  portno_token = newproxy()
+  portno_token = newproxy(),
+  -- set to bound the number of received packets waiting in the inbox
+  -- (see T.Mailbox.init for the available overflow policies)
+  inbox_capacity = nil,
+  inbox_policy = nil,
+  -- set to merge all packets put into the outbox within one scheduler turn
+  -- (or within `coalesce_delay` seconds) into a single write to the external
+  -- process; with explicit length framing the merged packets also go out as a
+  -- single USB transfer of at most `coalesce_max` bytes
+  coalesce = false,
+  coalesce_max = 512,
+  coalesce_delay = nil,
+  -- 'binary' switches the link to length-prefixed binary messages (see
+  -- extframing.lua) right after connecting, 'text' keeps the line based
+  -- protocol (easier to debug)
+  framing = 'text',
+  -- 'shm' passes the packets through a pair of shared memory rings (see
+  -- platform-linux/shmring.c) instead of a localhost TCP socket
+  transport = 'tcp',
+  shm_size = 1024 * 1024,
+  -- URBs kept in flight and the read transfer size of the `raw-usb` helper
+  usb_depth = nil,
+  usb_transfer_size = nil,
 }
 
 if os.platform == 'linux' or os.platform == 'osx' then
   ExtProc.usb_exe = os.executable_path..' :raw-usb'
+  ExtProc.usb_framing = 'binary'
 elseif os.platform == 'windows' then
   ExtProc.usb_exe = os.executable_dir..'/sepack-hid-win32.exe'
+  ExtProc.usb_framing = 'text'
 end
 
 function ExtProc:init (args, _log)
   self.log = _log or log.null
 
-  local lsock, err = assert(socket.bind ('127.0.0.1', 0))
-  io.setinherit(lsock, false)
-  lsock:settimeout (0)
-  local addr, port = lsock:getsockname()
-  self.lsock = lsock
-  self.port = port
-
-  self.args = {}
-  for i,v in ipairs(args) do
-    if v == self.portno_token then
-      self.args[i] = port
-    else
-      self.args[i] = args[i]
-    end
+  self.args = args
+  if self.transport == 'tcp' then
+    local lsock, err = assert(socket.bind ('127.0.0.1', 0))
+    io.setinherit(lsock, false)
+    lsock:settimeout (0)
+    local addr, port = lsock:getsockname()
+    self.lsock = lsock
+    self.port = port
+    self.args = self:_command(port)
+  elseif self.transport ~= 'shm' then
+    error('invalid ExtProc transport: '..tostring(self.transport), 3)
   end
 
-  self.inbox = T.Mailbox:new()
+  self.inbox = T.Mailbox:new(self.inbox_capacity, self.inbox_policy)
   self.outbox = T.Mailbox:new()
+  self.tx_packets = 0
+  self.tx_transfers = 0
+  self.tx_writes = 0
   self.status = o(false)
   self.serial = o()
   T.go(self._out_loop, self)
 
-  self.accept_watcher = loop.on_acceptable (lsock, function () T.go(self._handle_connect, self) end, true)
+  if self.lsock then
+    self.accept_watcher = loop.on_acceptable (self.lsock, function () T.go(self._handle_connect, self) end, true)
+  end
   T.go(self._start_loop, self)
 end
 
+-- the command arguments with `portno_token` replaced by `address`
+function ExtProc:_command(address)
+  local args = {}
+  for i,v in ipairs(self.args) do
+    if v == self.portno_token then
+      args[i] = address
+    else
+      args[i] = v
+    end
+  end
+  return args
+end
+
 function ExtProc.newUsb (class, product, serial, log)
   local args = {ExtProc.usb_exe, ExtProc.portno_token}
   if product then args[#args+1] = '.p'..product end
   if serial then args[#args+1] = '.s'..serial end
-  return class:new(args, log)
+  if class.usb_depth then args[#args+1] = '.d'..class.usb_depth end
+  if class.usb_transfer_size then args[#args+1] = '.z'..class.usb_transfer_size end
+  local ext = class:new(args, log)
+  ext.framing = class.usb_framing
+  return ext
 end
 
 function ExtProc:_start_loop()
   local cmd = table.concat(self.args, ' ')
   while true do
     local timeout = T.Timeout:new(self.respawn_period)
+    -- every process gets fresh rings
+    local ring
+    if self.transport == 'shm' then
+      ring = assert(require'shmring'.new(self.shm_size))
+      cmd = table.concat(self:_command(ring:address()), ' ')
+    end
     self.log:info("exec", cmd)
     self.exitbox = T.Mailbox:new()
     local err
     self.procin, err = io.popen(cmd, "w")
     if not self.procin then self.log:error("exec failed", D.unq(err)) end
+    if ring then
+      ring:close_remote()
+      if self.procin then T.go(self._ring_loop, self, ring) else ring:close() end
+    end
     self.exitbox:recv()
     self.exitbox = nil
     timeout:recv()
@@ -78,6 +132,13 @@ end
 function ExtProc:_handle_connect()
   local sock = self.lsock:accept()
   sock:settimeout(0)
+  self.write_frame = nil
+  if self.framing == 'binary' then
+    -- everything we send after this line is framed, the external process
+    -- acknowledges with the same line before it starts framing its output
+    loop.write(sock, "binary\n")
+    self.write_frame = F.writer()
+  end
   self.outfd = sock
   self.status(true)
   return self:_in_loop(sock)
@@ -108,18 +169,28 @@ function ExtProc.read_message(b)
   end
 end
 
+function ExtProc:_handle_message(data, cmd)
+  if data then
+    self.log:dbg('< '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
+    self.inbox:put(data)
+  else
+    local cmd, serial = string.splitv(cmd, ' ')
+    self.log:dbg('? '..cmd)
+    self.status(cmd)
+    self.serial(serial)
+  end
+end
+
 function ExtProc:_in_loop(infd)
   local inb = bio.IBuf:new(infd)
+  local read_message = self.read_message
   while true do
-    local data, cmd, err = self.read_message(inb)
-    if data then
-      self.log:dbg('< '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
-      self.inbox:put(data)
-    elseif cmd then
-      local cmd, serial = string.splitv(cmd, ' ')
-      self.log:dbg('? '..cmd)
-      self.status(cmd)
-      self.serial(serial)
+    local data, cmd, err, stream = read_message(inb)
+    if cmd == 'binary' then
+      self.log:dbg('? binary')
+      read_message = F.reader(inb)
+    elseif data or cmd then
+      self:_handle_message(data, cmd, stream)
     else
       if err == 'eof' then
         self.log:dbg('< eof')
@@ -131,21 +202,150 @@ function ExtProc:_in_loop(infd)
       end
     end
   end
+  if self.outfd == infd then self.outfd = nil end
   infd:close()
   self.exitbox:put(true)
 end
 
+-- The counterpart of `_handle_connect` and `_in_loop` for the 'shm' transport.
+-- The doorbell of the rings reports EOF when the process exits.
+function ExtProc:_ring_loop(ring)
+  self.ring = ring
+  self.status(true)
+  while true do
+    local ok, err = ring:clear()
+    while true do
+      local data, kind = ring:recv()
+      if not data then
+        if kind then ok, err = nil, kind end
+        break
+      end
+      if kind == F.DATA then
+        self:_handle_message(data)
+      else
+        self:_handle_message(nil, data)
+      end
+    end
+    if not ok then
+      if err == 'eof' then
+        self.log:dbg('< eof')
+        self.status(false)
+      else
+        self.log:error('input error', err)
+      end
+      break
+    end
+    loop.wait_readable(ring)
+  end
+  if self.ring == ring then self.ring = nil end
+  ring:close()
+  self.exitbox:put(true)
+end
+
+-- Puts a message into the outgoing ring, waits for the other side to make
+-- space (and ring the doorbell) if it is full.
+function ExtProc:_ring_send(ring, kind, data)
+  while true do
+    local ok, err = ring:send(data, kind)
+    if ok then return true end
+    if err ~= 'full' then
+      self.log:error('output error', err)
+      return nil, err
+    end
+    -- empty the doorbell, `_ring_loop` may be busy and would leave it readable
+    loop.wait_readable(ring)
+    ok, err = ring:clear()
+    if not ok then return nil, err end
+  end
+end
+
+-- Collects `data` together with all the packets that follow it in the outbox
+-- (up to the first command) and returns them as a list of transfers. Adjacent
+-- packets are merged into one transfer as long as it stays within
+-- `coalesce_max`.
+function ExtProc:_coalesce(data)
+  if self.coalesce_delay then
+    T.sleep(self.coalesce_delay)
+  else
+    T.Idle:recv()
+  end
+  local outbox = self.outbox
+  local transfers = {}
+  local transfer, size = {}, 0
+  while true do
+    self.log:dbg('> '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
+    self.tx_packets = self.tx_packets + 1
+    if size > 0 and (self.implicit_length or size + #data > self.coalesce_max) then
+      transfers[#transfers+1] = table.concat(transfer)
+      transfer, size = {}, 0
+    end
+    transfer[#transfer+1] = data
+    size = size + #data
+    local ok, msg = outbox:poll()
+    if not ok then break end
+    data = msg[1]
+    if type(data) ~= 'string' then
+      outbox:putback(unpack(msg))
+      break
+    end
+  end
+  transfers[#transfers+1] = table.concat(transfer)
+  return transfers
+end
+
+-- Writes all the `transfers` to the external process at once.
+function ExtProc:_send(transfers)
+  local ring = self.ring
+  if ring then
+    for i=1,#transfers do self:_ring_send(ring, F.DATA, transfers[i]) end
+    self.tx_transfers = self.tx_transfers + #transfers
+    return
+  end
+  local out, n = {}, 0
+  local write_frame = self.write_frame
+  for i=1,#transfers do
+    local data = transfers[i]
+    if write_frame then
+      out[n+1], out[n+2] = write_frame(F.DATA, data, nil, true)
+      n = n + 2
+    else
+      n = n + 1 out[n] = "tx "
+      n = n + 1 out[n] = #data
+      n = n + 1 out[n] = "\n"
+      n = n + 1 out[n] = data
+      n = n + 1 out[n] = "\n"
+    end
+  end
+  self.tx_transfers = self.tx_transfers + #transfers
+  self.tx_writes = self.tx_writes + 1
+  loop.writev(self.outfd, out)
+end
+
 function ExtProc:_out_loop()
   while true do
     local data = self.outbox:recv()
-    if self.outfd then
+    if self.outfd or self.ring then
       if type(data) == 'string' then
-        self.log:dbg('> '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
-        loop.write(self.outfd, table.concat{ "tx ", #data, "\n", data, "\n" })
+        if self.coalesce then
+          local transfers = self:_coalesce(data)
+          -- the process may have exited while the packets were collected
+          if self.outfd or self.ring then self:_send(transfers) end
+        else
+          self.log:dbg('> '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
+          self.tx_packets = self.tx_packets + 1
+          self:_send{ data }
+        end
       elseif type(data) == 'table' then
         self.log:dbg('> '..D.repr(data))
         local out = table.concat(data, " ")
-        loop.write(self.outfd, out.."\n")
+        self.tx_writes = self.tx_writes + 1
+        if self.ring then
+          self:_ring_send(self.ring, F.COMMAND, out)
+        elseif self.write_frame then
+          loop.write(self.outfd, self.write_frame(F.COMMAND, out))
+        else
+          loop.write(self.outfd, out.."\n")
+        end
       else
         self.log:err('error: unknown data format: '..D.repr(data))
       end
@@ -153,4 +353,16 @@ function ExtProc:_out_loop()
   end
 end
 
+-- Counters of the outgoing traffic: `packets` put into the outbox, USB
+-- `transfers` and socket `writes` they were sent in, and the average number of
+-- packets per transfer (`ratio`, above 1 only with `coalesce` set).
+function ExtProc:tx_stats()
+  return {
+    packets = self.tx_packets,
+    transfers = self.tx_transfers,
+    writes = self.tx_writes,
+    ratio = self.tx_transfers > 0 and self.tx_packets / self.tx_transfers or 1,
+  }
+end
+
 return ExtProc
@@ -0,0 +1,104 @@
+local Object = require'oo'
+
+local frexp = math.frexp
+local floor = math.floor
+local ceil = math.ceil
+
+--# Log-bucketed histograms
+--. A compact histogram of positive numbers (usually durations in seconds)
+--. with logarithmically sized buckets. Every power of two is split into
+--. `SUB_BUCKETS` linear buckets so the relative error of the reported
+--. quantiles stays below `1/SUB_BUCKETS` for any value range. Values smaller
+--. than `MIN_VALUE` are counted as `MIN_VALUE`.
+
+--$ Histogram = require'histogram'
+--$ h = Histogram:new()
+--$ for i=1,1000 do h:record(i / 1000) end
+--$ h.count, h.max
+--  1000 1
+--$ h:quantile(.5), h:quantile(.9), h:quantile(.99)
+--  0.53125 0.90625 1
+
+local Histogram = Object:inherit{
+  __type = 'Histogram',
+  SUB_BUCKETS = 16,
+  MIN_VALUE = 1e-6,
+}
+
+function Histogram:init()
+  self.counts = {}
+  self.count = 0
+  self.sum = 0
+  self.max = 0
+end
+
+function Histogram:record(v)
+  if v < self.MIN_VALUE then v = self.MIN_VALUE end
+  local sub = self.SUB_BUCKETS
+  local m, e = frexp(v) -- v = 2m * 2^(e-1) and 1 <= 2m < 2
+  local i = e * sub + floor((m * 2 - 1) * sub)
+  local counts = self.counts
+  counts[i] = (counts[i] or 0) + 1
+  self.count = self.count + 1
+  self.sum = self.sum + v
+  if v > self.max then self.max = v end
+end
+
+function Histogram:_limit(i)
+  local sub = self.SUB_BUCKETS
+  local e = floor(i / sub)
+  return (1 + (i - e * sub + 1) / sub) * 2^(e - 1)
+end
+
+-- the indexes of the non-empty buckets in ascending order
+local function sorted_buckets(self)
+  local idxs = {}
+  for i in pairs(self.counts) do idxs[#idxs+1] = i end
+  table.sort(idxs)
+  return idxs
+end
+
+local function quantile(self, idxs, q)
+  local target = ceil(q * self.count)
+  local n = 0
+  for _,i in ipairs(idxs) do
+    n = n + self.counts[i]
+    if n >= target then
+      return math.min(self:_limit(i), self.max)
+    end
+  end
+  return self.max
+end
+
+--. `histogram:quantile(q)` returns the upper limit of the bucket which contains
+--. the `q`-th quantile (but never more than the maximum recorded value).
+function Histogram:quantile(q)
+  if self.count == 0 then return nil end
+  return quantile(self, sorted_buckets(self), q)
+end
+
+--. `histogram:summary(scale = 1)` returns a table (suitable for JSON
+--. serialization) with the sample count, mean, maximum and the 50th, 90th,
+--. 99th and 99.9th percentiles multiplied by `scale`.
+
+--$ s = h:summary(1000)
+--$ s.count, s.p50, s.p90, s.max
+--  1000 531.25 906.25 1000
+function Histogram:summary(scale)
+  scale = scale or 1
+  local s = { count = self.count }
+  if self.count > 0 then
+    s.mean = self.sum / self.count * scale
+    s.max = self.max * scale
+    local idxs = sorted_buckets(self)
+    s.p50 = quantile(self, idxs, .5) * scale
+    s.p90 = quantile(self, idxs, .9) * scale
+    s.p99 = quantile(self, idxs, .99) * scale
+    s.p999 = quantile(self, idxs, .999) * scale
+  end
+  return s
+end
+
+--//
+
+return Histogram
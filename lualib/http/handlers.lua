@@ -1,3 +1,6 @@
+local T = require'thread'
+local json = require'cjson'
+
 local M = {}
 
 function M.FileHandler (root, file, opts)
@@ -17,4 +20,13 @@ function M.FileHandler (root, file, opts)
   end
 end
 
+-- Replies with the per thread runtime and wake-up latency histograms (see
+-- `thread.latency_info`) as JSON. A `?reset` query starts a new measurement.
+function M.ThreadLatencyHandler ()
+  return function (req)
+    local info = T.latency_info(req.query == 'reset')
+    return req:reply'OK':write(json.encode(info)):sendAs'json'
+  end
+end
+
 return M
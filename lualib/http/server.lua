@@ -191,32 +191,43 @@ function Reply.sendRedirect (self, newurl)
   self:sendEmpty()
 end
 
+local function total_length (t)
+  local len = 0
+  for i=1,#t do len = len + #t[i] end
+  return len
+end
+
 function Reply.sendEmpty (self)
   self:header ("Content-Length", 0)
   self[#self+1] = '\r\n'
-  local hdata = table.concat (self)
-  self.hlen = #hdata
-  loop.write (self.sock, hdata)
+  self.hlen = total_length (self)
+  loop.writev (self.sock, self)
   self.clen = 0
   self.req.done = self
 end
 
+-- The headers and the data are written in one go, without concatenating
+-- them.
 function Reply.sendAs (self, content_type)
-  local data = table.concat (self.data)
+  local data = self.data
+  local clen = total_length (data)
   content_type = self.ct_names[content_type] or content_type
   self:header ("Content-Type", content_type)
-  self:header ("Content-Length", #data)
+  self:header ("Content-Length", clen)
   self[#self+1] = '\r\n'
-  local hdata = table.concat (self)
-  self.hlen = #hdata
-  loop.write (self.sock, hdata)
-  self.clen = #data
-  loop.write (self.sock, data)
+  local parts = {}
+  for i=1,#self do parts[i] = self[i] end
+  self.hlen = total_length (parts)
+  for i=1,#data do parts[#parts+1] = data[i] end
+  loop.writev (self.sock, parts)
+  self.clen = clen
   self.req.done = self
 end
 
 function Reply.write(self, data)
   local b = self.data
+  -- numbers are written as text, as `table.concat` would do
+  if type(data) == 'number' then data = tostring(data) end
   b[#b+1] = data
   return self
 end
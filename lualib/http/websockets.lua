@@ -5,6 +5,8 @@ local loop = require'loop'
 
 local M = {}
 
+local U2, U8 = B.compile'>u2', B.compile'>u8'
+
 local function twoway(dict)
   local out = {}
   for k,v in pairs(dict) do
@@ -35,7 +37,7 @@ function WebSocket:init(req)
 end
 
 function WebSocket:readPacket(ibuf)
-  local head, err = ibuf:readstruct'>u2'
+  local head, err = ibuf:readstruct(U2)
   if not head then
     if err == 'eof' then return false end
     error(err)
@@ -43,9 +45,9 @@ function WebSocket:readPacket(ibuf)
   local p = B.unpackbits(head, 'FIN RSV1 RSV2 RSV3 opcode:4 MASK len:7')
   p.opcode = OPCODES[p.opcode]
   if p.len == 126 then
-    p.len = assert(ibuf:readstruct'>u2')
+    p.len = assert(ibuf:readstruct(U2))
   elseif p.len == 127 then
-    p.len = assert(ibuf:readstruct'>u8')
+    p.len = assert(ibuf:readstruct(U8))
   end
   local maskkey
   if p.MASK then
@@ -73,10 +75,15 @@ function WebSocket:formatLength(len, mask)
   end
 end
 
-function WebSocket:formatPacket(p)
+-- the frame header and the payload of packet `p`
+function WebSocket:packetParts(p)
   local data = p.data
   if p.maskkey then data = B.strxor(p.data, p.maskkey) end
-  return string.char(0x80 + OPCODES[p.opcode])..self:formatLength(#data, p.maskkey)..data
+  return { string.char(0x80 + OPCODES[p.opcode])..self:formatLength(#data, p.maskkey), data }
+end
+
+function WebSocket:formatPacket(p)
+  return table.concat(self:packetParts(p))
 end
 
 function WebSocket:readLoop()
@@ -101,8 +108,12 @@ end
 function WebSocket:writeLoop()
   while true do
     local p = self.outbox:recv()
-    if type(p) == 'table' then p = self:formatPacket(p) end
-    local ok, err = loop.write (self.req.sock, p)
+    local ok, err
+    if type(p) == 'table' then
+      ok, err = loop.writev (self.req.sock, self:packetParts(p))
+    else
+      ok, err = loop.write (self.req.sock, p)
+    end
     if not ok then
       if err == 'closed' then return end
       error(err)
@@ -63,39 +63,127 @@ function loop.run ()
   loop.default:loop()
 end
 
-function loop.read (file, len)
+-- One registration per file, shared by all the `loop.read` and `loop.write`
+-- calls on it (and so by `bio.IBuf`). Its `read` and `write` sides hold the
+-- threads waiting on them and a watcher which is created once and only
+-- started while some thread waits, instead of a new watcher and closures for
+-- every read that would block. libev keeps the descriptor in its epoll set
+-- while the watchers are stopped (and copes with a closed descriptor number
+-- being reused, as no watcher is left running on it). The registrations of
+-- objects go away with them, those of descriptor numbers are dropped with
+-- `loop.unregister`.
+local Side = {}
+Side.__index = Side
+
+local registrations = setmetatable({}, { __mode = 'k' })
+-- the list of waiting threads each blocked `Side:wait` is in
+local waiting_in = setmetatable({}, { __mode = 'k' })
+
+local function new_side (fd, events)
+  local side = setmetatable({ waiting = {}, spare = {} }, Side)
+  -- resumes all the waiting threads (which may start waiting again), except
+  -- those an earlier one of them resumed or killed meanwhile
+  side.watcher = ev.IO.new(function (loop, watcher, ev)
+    local waiting = side.waiting
+    side.waiting, side.spare = side.spare, waiting
+    watcher:stop(loop)
+    for i=1,#waiting do
+      local thd = waiting[i]
+      waiting[i] = nil
+      if waiting_in[thd] == waiting then T.resume(thd, true) end
+    end
+  end, fd, events)
+  return side
+end
+
+local function registration (file)
+  local r = registrations[file]
+  if r then return r end
+  local fd = convert_file(file)
+  r = { read = new_side(fd, ev.READ), write = new_side(fd, ev.WRITE) }
+  registrations[file] = r
+  return r
+end
+
+-- Waits until the file is ready, returns false if the thread was resumed by
+-- something else.
+function Side:wait ()
   local thd = T.current()
-  local cancel
-  local function handler ()
-    local data, err
-    if type(file) ~= 'number' and file.getsockname then
-      local partial
-      if file.receivefrom then
-        data, err = file:receive()
-      else
-        data, err, partial = file:receive(len or '*a')
-      end
-      if err == 'timeout' and partial then
-        data = partial
-        err = nil
-      end
+  if #self.waiting == 0 then self.watcher:start(loop.default) end
+  self.waiting[#self.waiting+1] = thd
+  waiting_in[thd] = self.waiting
+  local ok = T.yield()
+  waiting_in[thd] = nil
+  if not ok then
+    local waiting = self.waiting
+    for i=#waiting,1,-1 do
+      if waiting[i] == thd then table.remove(waiting, i) break end
+    end
+    if #waiting == 0 then self.watcher:stop(loop.default) end
+  end
+  return ok
+end
+
+-- Drops the registration of `file`, for descriptor numbers which are about
+-- to be closed. No thread may be waiting on it any more.
+function loop.unregister (file)
+  local r = registrations[file]
+  if not r then return end
+  r.read.watcher:stop(loop.default)
+  r.write.watcher:stop(loop.default)
+  registrations[file] = nil
+end
+
+local function read_now (file, len)
+  local data, err
+  if type(file) ~= 'number' and file.getsockname then
+    local partial
+    if file.receivefrom then
+      data, err = file:receive()
     else
-      data, err = io.raw_read(file, len)
+      data, err, partial = file:receive(len or '*a')
     end
-    if err == 'closed' then err = 'eof' end
-    if err ~= "timeout" then
-      cancel()
-      return T.resume (thd, true, data, err)
+    if err == 'timeout' and partial then
+      data = partial
+      err = nil
     end
+  else
+    data, err = io.raw_read(file, len)
   end
-  cancel = loop.on_readable (file, handler, true)
-  local ok, data, err = T.yield()
-  if not ok then cancel() return T.yield() end
+  if err == 'closed' then err = 'eof' end
   return data, err
 end
 
+function loop.read (file, len)
+  local r = registration(file)
+  while true do
+    if not r.read:wait() then return T.yield() end
+    local data, err = read_now(file, len)
+    if err ~= "timeout" then return data, err end
+  end
+end
+
+-- Reads up to `len` bytes from `file` straight into `buffer` (see
+-- `buffer:fill`), returns the number of bytes read or `nil, err`. Not on
+-- Windows, where sockets cannot be read with `read`.
+if os.platform ~= 'windows' then
+  function loop.fill (file, buffer, len)
+    local r = registration(file)
+    while true do
+      if not r.read:wait() then return T.yield() end
+      local n, err = buffer:fill(file, len)
+      if n ~= 0 then return n, err end
+    end
+  end
+end
+
+-- Waits until `file` becomes readable without reading from it (for files
+-- with their own read functions, like the doorbell of a `shmring`).
+function loop.wait_readable (file)
+  if not registration(file).read:wait() then return T.yield() end
+end
+
 function loop.write (file, data)
-  local thd = T.current()
   local len = #data
   local start = 1
   while start <= len do
@@ -116,15 +204,33 @@ function loop.write (file, data)
       return false, 'zero bytes written'
     elseif i < len then
       start = i + 1
-      local cancel = loop.on_writeable (file, function () return T.resume (thd, true) end)
-      local ok, err, arg = T.yield()
-      if not ok then cancel() return T.yield() end
+      if not registration(file).write:wait() then return T.yield() end
     else
       return true
     end
   end
 end
 
+-- Writes the strings (or buffers) of the list `parts` as if they were
+-- concatenated, without building the concatenation (see `io.raw_writev`).
+-- They are simply concatenated on Windows.
+if io.raw_writev then
+  function loop.writev (file, parts)
+    local n = #parts
+    local i, off = 1, 0
+    while true do
+      i, off = io.raw_writev(file, parts, i, off)
+      if not i then return nil, off end
+      if i > n then return true end
+      if not registration(file).write:wait() then return T.yield() end
+    end
+  end
+else
+  function loop.writev (file, parts)
+    return loop.write(file, table.concat(parts))
+  end
+end
+
 --[[
 do
   local pr, pw = os.pipe()
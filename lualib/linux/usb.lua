@@ -1,8 +1,10 @@
 local loop = require'loop'
 local T = require'thread'
 local udev = require'udev'
+local uevent = require'uevent'
 local _usb = require'_usb'
 local D = require'util'
+local Histogram = require'histogram'
 
 local usb = {
   _usb = _usb,
@@ -103,8 +105,16 @@ device.new = constructor(function (self, ctx, udevh)
     self[k] = udevh:get_sysattr_value(k)
   end
   self.callbacks = {}
+  -- reused by _do_reap
+  self.reaped = {}
+  self.reap_wakeups = 0
+  self.reap_count = 0
+  self.reap_max_batch = 0
 end)
 
+-- the maximum number of URBs reaped in one event loop wakeup
+device.reap_batch = 64
+
 function device:open()
   local fname = self.udevh:get_devnode()
   self.f = assert(io.open (fname, "r+"))
@@ -122,25 +132,72 @@ function device:set_configuration(cfgv)
       if intf:get_driver() then assert(intf:disconnect_kernel()) end
     end
   else
+    self.descriptors = nil
     return ok, err, errno
   end
+  self.descriptors = nil
   return _usb.set_configuration(self.f, cfgv)
 end
 
-function device:find_interfaces(filter)
-  assert(self.f, "usb device not open")
-  local intfs = {}
+-- Snapshot of the interfaces and endpoints of the active configuration,
+-- taken with a single udev enumeration of the device and kept until the
+-- configuration changes or the device is closed. The udev handles cache
+-- their sysfs attributes, so interface and endpoint objects created from
+-- them do not read sysfs again. Each interface entry indexes its endpoints by
+-- address and by type and direction.
+function device:_descriptor_cache()
+  local c = self.descriptors
+  if c then return c end
   local enum = self.ctx:enumerate()
-  assert(enum:add_match_property("DEVTYPE", "usb_interface"))
   assert(enum:add_match_parent(self.udevh))
-  if filter then
-    for i,k in ipairs(interface._attrs) do
-      if filter[k] then assert(enum:add_match_sysattr(k, filter[k])) end
-    end
-  end
   assert(enum:scan_devices())
+  local handles = {}
+  c = { interfaces = {} }
   for i,path in ipairs(enum:get_list()) do
-    intfs[#intfs+1] = interface:new(self.ctx, assert(self.ctx:device_from_syspath(path)), self)
+    local d = assert(self.ctx:device_from_syspath(path))
+    handles[path] = d
+    if d:get_sysattr_value'bInterfaceNumber' then
+      local attrs = {}
+      for _,k in ipairs(interface._attrs) do attrs[k] = d:get_sysattr_value(k) end
+      c.interfaces[#c.interfaces+1] = {
+        snapshot = c, path = path, udevh = d, attrs = attrs,
+        endpoints = {}, by_address = {}, by_kind = {},
+      }
+    end
+  end
+  for _,intf in ipairs(c.interfaces) do
+    local prefix = intf.path..'/'
+    for path,d in pairs(handles) do
+      local addr = path:sub(1, #prefix) == prefix and d:get_sysattr_value'bEndpointAddress'
+      if addr then
+        intf.endpoints[#intf.endpoints+1] = d
+        intf.by_address[tonumber(addr, 16)] = d
+        local kind = string.lower(d:get_sysattr_value'type' or '')..' '..(d:get_sysattr_value'direction' or '')
+        local l = intf.by_kind[kind] or {}
+        intf.by_kind[kind] = l
+        l[#l+1] = d
+      end
+    end
+  end
+  self.descriptors = c
+  return c
+end
+
+function device:find_interfaces(filter)
+  assert(self.f, "usb device not open")
+  local intfs = {}
+  for _,e in ipairs(self:_descriptor_cache().interfaces) do
+    local match = true
+    if filter then
+      for _,k in ipairs(interface._attrs) do
+        if filter[k] and e.attrs[k] ~= filter[k] then match = false end
+      end
+    end
+    if match then
+      local intf = interface:new(self.ctx, e.udevh, self)
+      intf.descriptors = e
+      intfs[#intfs+1] = intf
+    end
   end
   return intfs
 end
@@ -148,6 +205,7 @@ end
 function device:close ()
   self.f:close()
   self.f = nil
+  self.descriptors = nil
 end
 
 function device.__tostring (s)
@@ -187,7 +245,28 @@ function device:_handle_reap(token, ...)
 end
 
 function device:_do_reap ()
-  return self:_handle_reap(_usb.reap_urb(self.f))
+  local out = self.reaped
+  local n, err, errno = _usb.reap_all(self.f, out, self.reap_batch)
+  self.reap_wakeups = self.reap_wakeups + 1
+  self.reap_count = self.reap_count + n
+  if n > self.reap_max_batch then self.reap_max_batch = n end
+  for k=1,n*5,5 do
+    local data = out[k+1]
+    out[k+1] = nil -- do not keep the received data alive
+    self:_handle_reap(out[k], data, out[k+2], out[k+3], out[k+4])
+  end
+  if err then return self:_handle_reap(nil, err, errno) end
+end
+
+-- The number of writable event wakeups, of URBs reaped in them and the
+-- average and maximum number of URBs reaped per wakeup.
+function device:reap_stats ()
+  return {
+    wakeups = self.reap_wakeups,
+    reaped = self.reap_count,
+    mean_batch = self.reap_wakeups > 0 and self.reap_count / self.reap_wakeups or 0,
+    max_batch = self.reap_max_batch,
+  }
 end
 
 --
@@ -234,13 +313,37 @@ local function filter_endpoint(ep, filter)
   return true
 end
 
+-- the endpoint handles of the interface (see `device:_descriptor_cache`)
+function interface:_endpoint_cache()
+  local c = self.descriptors
+  if c and c.snapshot == self.dev.descriptors then return c end
+  local path = self.udevh:get_syspath()
+  for _,e in ipairs(self.dev:_descriptor_cache().interfaces) do
+    if e.path == path then
+      self.descriptors = e
+      return e
+    end
+  end
+  error('interface not found: '..path)
+end
+
 function interface:find_endpoints (filter)
-  local enum = assert(self.ctx:enumerate())
-  assert(enum:add_match_parent(self.udevh))
-  assert(enum:scan_devices())
+  local c = self:_endpoint_cache()
+  -- narrow down the candidates with the indexes, the filter decides
+  local candidates = c.endpoints
+  local addr, kind, dir
+  for i,v in ipairs(filter) do
+    if type(v) == 'number' then addr = v
+    elseif v == 'in' or v == 'out' then dir = v
+    else kind = v end
+  end
+  if addr then
+    candidates = { c.by_address[addr] }
+  elseif kind and dir then
+    candidates = c.by_kind[kind..' '..dir] or {}
+  end
   local r = {}
-  for i,path in ipairs(enum:get_list()) do
-    local d = assert(self.ctx:device_from_syspath(path))
+  for i,d in ipairs(candidates) do
     if filter_endpoint(d, filter) then
       r[#r+1] = endpoint:new(self.ctx, d, self)
     end
@@ -249,14 +352,9 @@ function interface:find_endpoints (filter)
 end
 
 function interface:get_endpoint (bEndpointNumber)
-  local enum = assert(self.ctx:enumerate())
-  assert(enum:add_match_parent(self.udevh))
-  assert(enum:scan_devices())
-  for i,path in ipairs(enum:get_list()) do
-    local d = assert(self.ctx:device_from_syspath(path))
-    if d:get_sysattr_value('bEndpointAddress') == bEndpointNumber then
-      return endpoint:new(self.ctx, d, self)
-    end
+  local d = self:_endpoint_cache().by_address[fromhex(bEndpointNumber)]
+  if d then
+    return endpoint:new(self.ctx, d, self)
   end
   return nil, 'endpoint not found'
 end
@@ -288,6 +386,29 @@ end
 --
 -- USB endpoint
 --
+
+-- Defaults for the number of URBs kept in flight on an endpoint (further
+-- transfers wait in a queue) and the transfer size used by `start_reading`,
+-- see `endpoint:configure`.
+endpoint.depth = 4
+endpoint.transfer_size = 2048
+endpoint.retry_delay = .1
+-- see `endpoint:configure`
+endpoint.zero_copy = false
+-- packets per isochronous URB, see `endpoint:configure`
+endpoint.iso_packets = 8
+
+-- submit functions with the signature of `_usb.bulk_read` and
+-- `_usb.bulk_write` by endpoint type
+local function iso_read(f, ep, packets, pool, packet_size)
+  return _usb.iso_read(f, ep, packets, packet_size)
+end
+local function iso_write(f, ep, data, pool, packet_size)
+  return _usb.iso_write(f, ep, data, packet_size)
+end
+local readers = { bulk = _usb.bulk_read, interrupt = _usb.interrupt_read, isoc = iso_read }
+local writers = { bulk = _usb.bulk_write, interrupt = _usb.interrupt_write, isoc = iso_write }
+
 endpoint.new = constructor(function (self, ctx, udevh, intf)
   self.ctx = ctx
   self.intf = intf
@@ -297,27 +418,194 @@ endpoint.new = constructor(function (self, ctx, udevh, intf)
   self.bEndpointAddress = udevh:get_sysattr_value'bEndpointAddress'
   self.type = udevh:get_sysattr_value'type'
   self.direction = udevh:get_sysattr_value'direction'
+  local kind = string.lower(self.type or '')
+  self.submit_read = readers[kind] or _usb.bulk_read
+  self.submit_write = writers[kind] or _usb.bulk_write
+  self.isoc = kind == 'isoc'
+  -- bits 11-12 of wMaxPacketSize are the additional transactions per microframe
+  local w = tonumber(udevh:get_sysattr_value'wMaxPacketSize' or '', 16) or 0
+  self.max_packet_size = (w % 2048) * (1 + math.floor(w / 2048) % 4)
+
+  self.pool = _usb.pool(self.transfer_size)
+  self.queue = T.Fifo.new()
+  self.inflight = 0
+  -- completions are delivered in submission order
+  self.next_seq = 0
+  self.deliver_seq = 0
+  self.done = {}
+  -- statistics
+  self.submitted = 0
+  self.completed = 0
+  self.max_inflight = 0
+  self.turnaround = Histogram:new()
+  self.empty_time = 0
+  self.empty_since = T.now()
 end)
 
-function endpoint:write(data, callback)
-  local token, err, errno = _usb.bulk_write(self.f, fromhex(self.bEndpointAddress), data) -- 0x03
-  if not token then
-    return callback(nil, err, true, errno)
+function endpoint:configure(o)
+  if o.depth then
+    assert(o.depth >= 1, 'invalid endpoint depth')
+    self.depth = o.depth
+  end
+  if o.transfer_size then self.transfer_size = o.transfer_size end
+  if o.iso_packets then
+    assert(o.iso_packets >= 1 and o.iso_packets <= 128, 'invalid number of ISO packets')
+    self.iso_packets = o.iso_packets
+  end
+  -- Zero copy mode: the transfer buffers are mapped from usbfs (where the
+  -- kernel supports it) and reads without a `dst` buffer return views of
+  -- them instead of strings (`view:get()` makes a string, `view:release()`
+  -- hands the buffer back right away instead of waiting for the collector).
+  if o.zero_copy ~= nil and o.zero_copy ~= self.zero_copy then
+    self.zero_copy = o.zero_copy
+    self.pool = _usb.pool(self.transfer_size, o.zero_copy and self.f or nil)
+  end
+  self:_pump()
+  return self
+end
+
+function endpoint:_deliver()
+  local done = self.done
+  while true do
+    local seq = self.deliver_seq
+    local r = done[seq]
+    if not r then break end
+    done[seq] = nil
+    self.deliver_seq = seq + 1
+    r[1](unpack(r, 2, r.n))
   end
-  self.dev.callbacks[token] = callback
 end
 
-function endpoint:read(n, callback)
+function endpoint:_submit(submit, arg, callback, dst)
+  local seq = self.next_seq
+  self.next_seq = seq + 1
+  local t0 = T.now()
+  if self.inflight == 0 then self.empty_time = self.empty_time + (t0 - self.empty_since) end
+  self.inflight = self.inflight + 1
+  if self.inflight > self.max_inflight then self.max_inflight = self.inflight end
+  self.submitted = self.submitted + 1
+  local function complete(...)
+    local now = T.now()
+    self.inflight = self.inflight - 1
+    self.completed = self.completed + 1
+    self.turnaround:record(now - t0)
+    if self.inflight == 0 then self.empty_since = now end
+    self.done[seq] = { callback, n = select('#', ...) + 1, ... }
+    self:_deliver()
+    return self:_pump()
+  end
   -- fd might be already closed with asynchronous disconnection
   if not io.getfd(self.f) then
-    callback(nil, "ENODEV", true, 19)
-  else
-    local token, err, errno = _usb.bulk_read(self.f, fromhex(self.bEndpointAddress), n) -- 0x83
-    if not token then
-      return callback(nil, err, true, errno)
+    return complete(nil, "ENODEV", true, ENODEV)
+  end
+  local token, err, errno = submit(self.f, fromhex(self.bEndpointAddress), arg, self.pool, dst)
+  if not token then
+    return complete(nil, err, true, errno)
+  end
+  self.dev.callbacks[token] = complete
+end
+
+-- submits the queued transfers while there are free slots
+function endpoint:_pump()
+  local queue = self.queue
+  while self.inflight < self.depth and queue:len() > 0 do
+    local t = queue:pop()
+    self:_submit(t[1], t[2], t[3], t[4])
+  end
+end
+
+function endpoint:_enqueue(submit, arg, callback, dst)
+  if self.inflight < self.depth and self.queue:len() == 0 then
+    return self:_submit(submit, arg, callback, dst)
+  end
+  self.queue:push({ submit, arg, callback, dst })
+end
+
+-- Bulk and interrupt endpoints send `data` in one transfer, isochronous ones
+-- in packets of `max_packet_size` bytes (see `endpoint:iso_write`).
+function endpoint:write(data, callback)
+  if self.isoc then return self:iso_write(data, callback) end
+  return self:_enqueue(self.submit_write, data, callback) -- 0x03
+end
+
+-- With a `dst` buffer the data is appended to it and the callback gets the
+-- number of received bytes instead of a string. Isochronous endpoints read
+-- `n` bytes worth of packets (see `endpoint:iso_read`).
+function endpoint:read(n, callback, dst)
+  if self.isoc then
+    return self:iso_read(math.max(1, math.ceil(n / self.max_packet_size)), callback)
+  end
+  if dst == nil and self.zero_copy then dst = true end
+  return self:_enqueue(self.submit_read, n, callback, dst) -- 0x83
+end
+
+-- Isochronous transfers reserve bandwidth in every (micro)frame. Each URB
+-- carries several packets (at most one per frame) and the callback gets
+-- `(result, err, fatal, errno)`. The result is a table with the `lengths` and
+-- `status` (0 or errno) of every packet, the number of failed packets as
+-- `errors` and the `start_frame`. For reads the payload of the good packets
+-- is concatenated in `result.data`.
+function endpoint:iso_read(packets, callback)
+  return self:_enqueue(iso_read, packets or self.iso_packets, callback, self.max_packet_size)
+end
+
+function endpoint:iso_write(data, callback)
+  return self:_enqueue(iso_write, data, callback, self.max_packet_size)
+end
+
+-- Keeps `depth` reads of `transfer_size` bytes in flight and calls
+-- `callback(data, err, fatal, errno)` for each of them (in order) until
+-- `stop_reading` is called or the device disappears. Failed reads are retried
+-- after `retry_delay`. The data goes into `dst` if given (see `read`).
+-- Isochronous endpoints keep URBs of `iso_packets` packets in flight and
+-- pass the packet tables of `iso_read` to the callback.
+function endpoint:start_reading(callback, dst)
+  self.reader = callback
+  local on_data
+  local function resubmit()
+    if self.reader ~= callback then return end
+    if self.isoc then return self:iso_read(self.iso_packets, on_data) end
+    self:read(self.transfer_size, on_data, dst)
+  end
+  function on_data(data, err, fatal, errno)
+    if self.reader ~= callback then return end
+    callback(data, err, fatal, errno)
+    if data then
+      resubmit()
+    elseif errno == ENODEV then
+      self.reader = nil
+    else
+      loop.run_after(self.retry_delay, resubmit)
     end
-    self.dev.callbacks[token] = callback
   end
+  for i=self.inflight+self.queue:len()+1,self.depth do resubmit() end
+end
+
+function endpoint:stop_reading()
+  self.reader = nil
+end
+
+-- URB statistics: the turnaround times (from submission to reaping, in ms)
+-- and the total time (in seconds) without any URB in flight (for IN
+-- endpoints the data arriving then has to wait in the device).
+function endpoint:stats()
+  local empty = self.empty_time
+  if self.inflight == 0 then empty = empty + (T.now() - self.empty_since) end
+  local allocated, reused, _, mapped = self.pool:stats()
+  return {
+    depth = self.depth,
+    transfer_size = self.transfer_size,
+    submitted = self.submitted,
+    completed = self.completed,
+    inflight = self.inflight,
+    max_inflight = self.max_inflight,
+    queued = self.queue:len(),
+    empty_time = empty,
+    turnaround = self.turnaround:summary(1e3),
+    urbs_allocated = allocated,
+    urbs_reused = reused,
+    buffers_mapped = mapped,
+  }
 end
 
 function endpoint.__tostring(s)
@@ -335,37 +623,54 @@ local dev_filters = { 'idVendor', 'idProduct', 'bcdDevice' }
 
 local monitor = O()
 
-monitor.new = constructor(function (self, ctx)
-  self.inner = ctx:monitor("kernel")
-  assert(self.inner:filter_add_match_subsystem_devtype("usb", "usb_device"))
-  assert(self.inner:enable_receiving())
+-- The kernel events are filtered in C (see `platform-linux/l_uevent.c`) so
+-- the events of unrelated devices never reach Lua. `o` holds the same
+-- `dev_filters` as `usb.watch`.
+monitor.new = constructor(function (self, ctx, o)
+  self.ctx = ctx
+  self.inner = assert(uevent.monitor{
+    subsystem = "usb",
+    devtype = "usb_device",
+    idVendor = o.idVendor,
+    idProduct = o.idProduct,
+    bcdDevice = o.bcdDevice,
+  })
 end)
 
-function monitor:enable(add, remove)
+function monitor:enable(add, remove, bind)
   local function read_dev(loop, watcher, ev)
-    local d = self.inner:receive_device()
-    if not d then return end
-    local action = d:get_action()
-    local path = d:get_syspath()
-    if action == 'add' then
-      add(d, path)
-    elseif action == 'remove' then
-      remove(d, path)
-    elseif action == 'bind' or action == 'unbind' then
-      -- these new events were added in linux 4.12, see:
-      -- https://github.com/systemd/systemd/issues/8221
-    else
-      error(string.format('unknown udev action: %s for device: %s', action, udev_id(d)))
+    while true do
+      local action, path = self.inner:receive()
+      if not action then return end
+      if action == 'add' then
+        -- nil when the device is already gone
+        local d = self.ctx:device_from_syspath(path)
+        if d then add(d, path) end
+      elseif action == 'remove' then
+        remove(nil, path)
+      elseif action == 'bind' then
+        -- this new event was added in linux 4.12, see:
+        -- https://github.com/systemd/systemd/issues/8221
+        if bind then bind(nil, path) end
+      elseif action ~= 'unbind' and action ~= 'change' then
+        error(string.format('unknown uevent action: %s for device: %s', action, path))
+      end
     end
   end
   self.cancel_watcher = loop.on_readable(self.inner, read_dev, true)
 end
 
+-- number of events received, passed to Lua and lost in receive buffer overruns
+function monitor:stats()
+  return self.inner:stats()
+end
+
 function monitor:disable()
   if self.cancel_watcher then
     self.cancel_watcher()
     self.cancel_watcher = nil
   end
+  self.inner:close()
 end
 
 local function enumerate(ctx, o, callback)
@@ -385,49 +690,129 @@ local function enumerate(ctx, o, callback)
   end
 end
 
+-- Calls `o.connect(d)` for the matching devices which are present and
+-- `o.connect(d)`/`o.disconnect(d)` when they are plugged in or out later.
+-- Up to `o.concurrency` devices are connected at the same time (each
+-- connect runs in its own thread), `o.coldplug_end()` is called once the
+-- devices found at startup are connected. Hotplugged devices are only
+-- connected after their `bind` event (i.e. once the kernel is done
+-- configuring them and probing its drivers, which could otherwise snatch the
+-- device from us), or after `o.bind_timeout` seconds on kernels older than
+-- 4.12. The returned watcher's `connect_stats()` reports the time each device
+-- waited for its bind event and spent in `o.connect`.
 function usb.watch(o)
   assert(o.connect, "connect callback required")
-  local agent = T.agent()
+  local concurrency = o.concurrency or 8
+  local bind_timeout = o.bind_timeout or .5
   local ctx = udev.context()
   local devices = {}
-  
+  local stats = {}
+  local queue = T.Fifo.new() -- devices waiting to be connected
+  local active = 0  -- connects in progress
+  local binds = {} -- path -> Mailbox of a device waiting for its bind event
+  local connected = {} -- device -> 'connecting' or 'connected'
+  local coldplug_pending = 0
+
   local watcher = all_watchers:add({
-    agent = agent,
     udevctx = ctx,
     devices = devices,
   })
 
-  local monitor = monitor:new(ctx)
+  local function coldplug_done()
+    coldplug_pending = coldplug_pending - 1
+    if coldplug_pending == 0 and o.coldplug_end then o.coldplug_end() end
+  end
+
+  local function disconnect(d)
+    local ok, err = T.xpcall(function () return o.disconnect(d) end, debug.traceback)
+    if not ok then T.report_error(T.current(), err) end
+  end
+
+  -- `bound` is the Mailbox receiving the bind event of a hotplugged device
+  local function connect(d, path, bound)
+    local t0 = T.now()
+    if bound then
+      T.recv{
+        [bound] = function () end,
+        [T.Timeout:new(bind_timeout)] = function () end,
+      }
+      if binds[path] == bound then binds[path] = nil end
+    end
+    local t1 = T.now()
+    if devices[path] == d then
+      connected[d] = 'connecting'
+      local ok, err = T.xpcall(function () return o.connect(d) end, debug.traceback)
+      if not ok then T.report_error(T.current(), err) end
+      stats[path] = { wait = t1 - t0, connect = T.now() - t1 }
+      if devices[path] == d then
+        connected[d] = 'connected'
+      else -- unplugged while connecting
+        connected[d] = nil
+        if o.disconnect then disconnect(d) end
+      end
+    end
+    if not bound then coldplug_done() end
+  end
+
+  -- queues a device (if given) and starts the connects there is room for
+  local function schedule(d, path, bound)
+    if d then queue:push({ d, path, bound }) end
+    while active < concurrency and queue:len() > 0 do
+      local job = queue:pop()
+      active = active + 1
+      T.go(function ()
+        connect(job[1], job[2], job[3])
+        active = active - 1
+        schedule()
+      end)
+    end
+  end
+
+  local monitor = monitor:new(ctx, o)
+  -- held until all the coldplugged devices are queued
+  coldplug_pending = 1
   enumerate(ctx, o, function(ud, path)
     local d = device:new(ctx, ud)
     devices[path] = d
-    agent(o.connect, d)
+    coldplug_pending = coldplug_pending + 1
+    schedule(d, path)
   end)
-  if o.coldplug_end then agent(o.coldplug_end) end
+  T.go(coldplug_done)
   local function adddev(ud, path)
     if devices[path] then return end
-    for i,k in ipairs(dev_filters) do
-      if o[k] and ud:get_sysattr_value(k) ~= o[k] then return end
-    end
     local d = device:new(ctx, ud)
     devices[path] = d
-    agent(function ()
-      -- workaround a possible race with kernel drivers
-      -- otherwise we may succeed with set_configuration and even claim_interface
-      -- but the device may still be snatched away from us and reconfigured by the kernel driver
-      -- FIXME: maybe this could be fixed using the new `bind` udev event added in linux 4.12?
-      T.sleep(.5)
-      o.connect(d)
-    end)
+    local bound = T.Mailbox:new()
+    binds[path] = bound
+    schedule(d, path, bound)
+  end
+  local function binddev(ud, path)
+    if binds[path] then binds[path]:put(true) end
   end
   local function remdev(ud, path)
     local d = devices[path]
     if not d then return end
-    if o.disconnect then agent(o.disconnect, d) end
     devices[path] = nil
+    if binds[path] then
+      binds[path]:put(false)
+      binds[path] = nil
+    end
+    -- devices still waiting for their turn are not connected at all, the
+    -- ones being connected are disconnected when done
+    if connected[d] == 'connected' then
+      connected[d] = nil
+      if o.disconnect then T.go(disconnect, d) end
+    end
   end
-  monitor:enable(adddev, remdev)
-  return { disable = function () monitor:disable() all_watchers:remove(watcher) end }
+  monitor:enable(adddev, remdev, binddev)
+  return {
+    disable = function ()
+      monitor:disable()
+      all_watchers:remove(watcher)
+    end,
+    connect_stats = function () return stats end,
+    monitor_stats = function () return monitor:stats() end,
+  }
 end
 
 return usb
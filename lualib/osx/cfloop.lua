@@ -30,6 +30,14 @@ function loop.read (file, len)
   return data, err
 end
 
+-- Waits until `file` becomes readable without reading from it.
+function loop.wait_readable (file)
+  local thd = T.current()
+  local cancel = loop.on_readable(file, function () return T.resume(thd, true) end)
+  local ok, err, arg = T.yield()
+  if not ok then cancel() error(err, arg) end
+end
+
 function loop.write (file, data)
   local thd = T.current()
   local len = #data
@@ -61,6 +69,11 @@ function loop.write (file, data)
   end
 end 
 
+-- the parts are simply concatenated here (see `loop.writev` in the libev loop)
+function loop.writev (file, parts)
+  return loop.write(file, table.concat(parts))
+end
+
 --[[
 do
   local pr, pw = os.pipe()
@@ -92,8 +92,7 @@ function Sepack.write (self, chname, data, flags, cont)
       D.green(chname..'>')(data)
     end
   end
-  local t = { "tx ", #data, "\n", data, "\n" }
-  loop.write(self.sock, table.concat(t))
+  loop.writev(self.sock, { "tx ", #data, "\n", data, "\n" })
 end
 
 function Sepack.recv (self, chname)
@@ -3,8 +3,7 @@ local O = require'o'
 local T = require'thread'
 local B = require'binary'
 local o = require'kvo'
-local bit_ok, bit = T.spcall(require, 'bit') if not bit_ok then bit = nil end
-local bit32_ok, bit32 = T.spcall(require, 'bit32') if not bit32_ok then bit32 = nil end
+local codec = require'_sepack'
 
 -- all flags are >> 1 compared to sepack-lpc1342 C code
 local NO_REPLY_FLAG = 0x01
@@ -37,15 +36,19 @@ local function ExtProc_connect(address)
   if devname then
     return require'cosepack-serial':new('/dev/ttyS1', log)
   end
-  local usb_spec = string.match(address, "usb:?(.-)")
+  -- `iusb` drives the device from this process instead of a `raw-usb` subprocess,
+  -- `musb` shares one `usb-broker` subprocess with all the other `musb` addresses
+  local transport, usb_spec = string.match(address, "^([im]?)usb:?(.*)$")
   if usb_spec then
     local usb_product, usb_serial
-    if usb_spec:startswith("SEPACK-") then
+    if usb_spec == "" then
+    elseif usb_spec:startswith("SEPACK-") then
       usb_product = usb_spec
     else
       usb_serial = usb_spec
     end
-    return require'extproc':newUsb(usb_product, usb_serial, log)
+    local module = transport == 'i' and 'usblink' or transport == 'm' and 'usbbroker' or 'extproc'
+    return require(module):newUsb(usb_product, usb_serial, log)
   end
   error('invalid sepack address: '..tostring(address))
 end
@@ -60,6 +63,8 @@ Sepack.open = function (self, args)
   args = args or {}
   local addr = args.address or "usb"
   local ext = ExtProc_connect(addr)
+  -- merge the writes issued within one scheduler turn (see ExtProc.coalesce)
+  if args.coalesce then ext.coalesce = true end
   local log = args.log or log:sub'sepack'
   local sepack = self:new(ext, log)
   sepack.address = addr
@@ -168,91 +173,47 @@ function Sepack:chn(name)
   return chn
 end
 
-do
-  local function parse_packet(p, i, implicit_length)
-    local head = p:byte(i)
-    local id, final, flags
-    if bit ~= nil then
-      id = bit.band(head, 0xf)
-      final = bit.band(head, 0x10) == 0
-      flags = bit.rshift(bit.band(head, 0xe0), 5)
-    else
-      id = bit32.extract (head, 0, 4)
-      final = bit32.extract (head, 4) == 0
-      flags = bit32.extract (head, 5, 3)
-    end
-    local len, data
-    if implicit_length then
-      len = #p - 1
-      data = p:sub(i+1)
-      i = i+1+len
-    else
-      len = p:byte(i+1)
-      data = p:sub(i+2, i+2+len-1)
-      i = i+2+len
-    end
-    return id, data, flags, final, i
-  end
-
-  function Sepack:_in_loop ()
-    local events = {
-      [self.ext.inbox] = function (p)
-        if self.verbose > 2 then self.log:cyan(string.format('<<[%d]', #p), hex_trunc(p, 20)) end
-        local i = 1
-        local id, data, flags, final
-        while i <= #p do
-          id, data, flags, final, i = parse_packet(p, i, self.ext.implicit_length)
-          local channel = self.channels[id]
-          if self.verbose > 1 or not channel then
-            self.log:green(string.format('<%s%s:%x', channel and channel.name or 'ch?',
-                                                     final and "" or "+",
-                                                     flags),
-                           D.hex(data))
-          end
-          if channel then
-            -- channel.bytes_received = (channel.bytes_received or 0) + #data
-            channel:_handle_rx(data, flags, final)
-          end
+function Sepack:_in_loop ()
+  local frames = {}
+  local events = {
+    [self.ext.inbox] = function (p)
+      if self.verbose > 2 then self.log:cyan(string.format('<<[%d]', #p), hex_trunc(p, 20)) end
+      local n = codec.demux(p, self.ext.implicit_length, frames)
+      for k=1,n*4,4 do
+        local id, data, flags, final = frames[k], frames[k+1], frames[k+2], frames[k+3]
+        local channel = self.channels[id]
+        if self.verbose > 1 or not channel then
+          self.log:green(string.format('<%s%s:%x', channel and channel.name or 'ch?',
+                                                   final and "" or "+",
+                                                   flags),
+                         D.hex(data))
         end
-      end,
-      [self.ext.status] = function (...) self:_ext_status(...) end,
-    }
-    while true do T.recv(events) end
-  end
+        if channel then
+          -- channel.bytes_received = (channel.bytes_received or 0) + #data
+          channel:_handle_rx(data, flags, final)
+        end
+      end
+    end,
+    [self.ext.status] = function (...) self:_ext_status(...) end,
+  }
+  while true do T.recv(events) end
 end
 
-do
-  local function format_packet(id, data, flags, final, implicit_length)
-    flags = (flags or 0) * 2
-    if not final then flags = flags + 1 end
-    if implicit_length then
-      return string.char(id + (flags * 16))..data
-    else
-      return string.char(id + (flags * 16), #data)..data
-    end
-  end
-
-  function Sepack:write (channel, data, flags)
-    if self.verbose > 1 then self.log:green(string.format ("%s:%x>", channel.name, flags or 0), D.hex(data)) end
+function Sepack:write (channel, data, flags)
+  if self.verbose > 1 then self.log:green(string.format ("%s:%x>", channel.name, flags or 0), D.hex(data)) end
+  if self.ext.implicit_length then
     local pkgs = {}
-    repeat
-      local final = #data <= 62
-      local p = format_packet(channel.id, data:sub(1,62), flags, final, self.ext.implicit_length)
-      pkgs[#pkgs+1] = p
-      data = data:sub(63)
-    until #data == 0
-    if self.ext.implicit_length then
-      for _,out in ipairs(pkgs) do
-        if self.verbose > 2 then
-          self.log:cyan(string.format('>>[%d]', #out), hex_trunc(out, 20))
-        end
-        self.ext.outbox:put(out)
+    for i=1,codec.frames(channel.id, data, flags, pkgs) do
+      local out = pkgs[i]
+      if self.verbose > 2 then
+        self.log:cyan(string.format('>>[%d]', #out), hex_trunc(out, 20))
       end
-    else
-      local out = table.concat(pkgs)
-      if self.verbose > 2 then self.log:cyan(string.format('>>[%d]', #out), hex_trunc(out, 20)) end
       self.ext.outbox:put(out)
     end
+  else
+    local out = codec.frame(channel.id, data, flags)
+    if self.verbose > 2 then self.log:cyan(string.format('>>[%d]', #out), hex_trunc(out, 20)) end
+    self.ext.outbox:put(out)
   end
 end
 
@@ -730,6 +691,11 @@ CT.notify.__tostring = CT._default.__tostring
 
 
 CT.adc = O(CT._default)
+-- when true, received sample blocks are compact `binary.array` objects
+-- (indexable and with a length but no `ipairs`) instead of Lua tables
+CT.adc.arrays = false
+
+local ADC_SAMPLE = B.compile'>u2'
 
 function CT.adc:start(fs)
   local reply = checkerr(self.sepack:setup(self, B.enc32BE(fs)))
@@ -745,13 +711,8 @@ function CT.adc:stop()
 end
 
 function CT.adc:_decode(data)
-  local r = {}
-  assert(#data % 2, "invalid ADC data length")
-  for i=1,#data,2 do
-    local v = B.dec16BE(data, i)
-    r[#r+1] = v
-  end
-  return r
+  assert(#data % 2 == 0, "invalid ADC data length")
+  return (B.unpack_array(data, ADC_SAMPLE, self.arrays and 'array' or nil))
 end
 
 CT.adc.__tostring = CT._default.__tostring
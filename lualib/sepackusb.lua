@@ -0,0 +1,120 @@
+local T = require'thread'
+local E = require'errno'
+local O = require'o'
+local loop = require'loop'
+
+-- The USB side of a sepack device, shared by `raw-usb.lua`, `usb-broker.lua`
+-- and `UsbLink`: opening the device, the bulk reads kept in flight on its IN
+-- endpoint and the error rate after which the device is given up.
+local M = {}
+
+-- Opens the sepack device `d` and returns its bulk IN and OUT endpoints, or
+-- nothing when another process has it open. Where the usb module keeps the
+-- URBs in flight itself, the endpoints are configured with the
+-- `read_depth`, `read_size` and `write_depth` fields of `o`. `o.log(msg)`
+-- (if given) reports a device reset.
+function M.open(d, o)
+  local ok, err = T.spcall(d.open, d)
+  if not ok then
+    if err:endswith("USBDeviceOpen: (iokit/common) exclusive access and device already open (0xe00002c5)") then -- FIXME
+      return nil
+    end
+    return error(err, 0)
+  end
+  ok, err = d:set_configuration(2)
+  if not ok then
+    if not d.reset then error('set_configuration: '..tostring(err), 0) end
+    if o.log then o.log('set_configuration: '..tostring(err)..', performing device reset') end
+    assert(d:reset())
+    assert(d:set_configuration(2))
+  end
+  local intf = assert(d:find_interfaces{ bInterfaceClass = 'ff' }[1], 'vendor interface not found')
+  assert(intf:open())
+  local pin = assert(intf:find_endpoints{'bulk', 'in'}[1])
+  local pout = assert(intf:find_endpoints{'bulk', 'out'}[1])
+  if pin.configure then
+    pin:configure{ depth = o.read_depth, transfer_size = o.read_size }
+    pout:configure{ depth = o.write_depth }
+  end
+  return pin, pout
+end
+
+-- Returns true if the error `errno` of a transfer means that the device is
+-- gone.
+function M.disconnected(errno)
+  local errc = E[errno]
+  return errc == "ENODEV" or errc == "ESHUTDOWN" or errc == "iokit/NoDevice"
+end
+
+-- Keeps reads in flight on the IN endpoint `pin` and passes the received
+-- packets to `o.data(data)` and the errors to `o.error(err, fatal, errno)`,
+-- except for the transfers aborted by closing the device. Where the endpoint
+-- does the reading itself (see `M.open`) it goes on until
+-- `pin:stop_reading()`, otherwise `o.read_depth` reads of `o.read_size` bytes
+-- are resubmitted (failed ones after a pause) as long as `o.active()`
+-- returns true.
+function M.start_reads(pin, o)
+  local on_data, on_error = o.data, o.error
+  local function failed(err, fatal, errno)
+    if E[errno] ~= "iokit/Aborted" then on_error(err, fatal, errno) end
+  end
+  if pin.start_reading then
+    return pin:start_reading(function (data, err, fatal, errno)
+      if data then
+        on_data(data)
+      else
+        failed(err, fatal, errno)
+      end
+    end)
+  end
+  local active = o.active or function () return true end
+  local read_cb, read
+  function read_cb(data, err, fatal, errno)
+    if not active() then return end
+    if data then
+      on_data(data)
+      read()
+    else
+      failed(err, fatal, errno)
+      loop.run_after(.1, function () if active() then read() end end)
+    end
+  end
+  function read()
+    pin:read(o.read_size or 2048, read_cb)
+  end
+  for i=1,o.read_depth or 4 do read() end
+end
+
+-- Counts the errors of a device within the last `period` seconds (1 by
+-- default) and keeps their descriptions for the final report.
+local ErrorRate = O()
+M.ErrorRate = ErrorRate
+
+ErrorRate.new = O.constructor(function (self, max, period)
+  self.max = max
+  self.period = period or 1
+  self.recent = T.Fifo.new()
+end)
+
+-- Records an error, returns true once there were more than `max` of them
+-- within `period` seconds.
+function ErrorRate:put(msg)
+  local now = T.now()
+  local recent = self.recent
+  recent:push({ now, msg })
+  while recent:peek()[1] < now - self.period do recent:pop() end
+  return recent:len() > self.max
+end
+
+-- Returns the descriptions of the recent errors, the oldest first.
+function ErrorRate:messages()
+  local recent, t = self.recent, {}
+  for i=recent.head,recent.tail do t[#t+1] = recent[i][2] end
+  return t
+end
+
+function ErrorRate:reset()
+  self.recent = T.Fifo.new()
+end
+
+return M
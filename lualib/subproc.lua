@@ -133,6 +133,7 @@ function subproc:communicate(input)
             else
                 out = table.concat(out)
                 if err == 'eof' then err = nil end
+                loop.unregister(self._stdout.r)
                 io.raw_close(self._stdout.r)
                 chn:put(out, err)
                 return
@@ -154,6 +155,7 @@ function subproc:communicate(input)
             else
                 out = table.concat(out)
                 if err == 'eof' then err = nil end
+                loop.unregister(self._stderr.r)
                 io.raw_close(self._stderr.r)
                 errchn:put(out, err)
                 return
@@ -162,6 +164,7 @@ function subproc:communicate(input)
     end)
 
     loop.write(self._stdin.w, input)
+    loop.unregister(self._stdin.w)
     io.raw_close(self._stdin.w)
 
     local stdout, err = chn:recv()
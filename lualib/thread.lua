@@ -1,4 +1,5 @@
 local Object = require'oo'
+local Histogram = require'histogram'
 local socket = require'socket'
 
 local create = coroutine.create
@@ -76,20 +77,60 @@ local function getname (thd)
 end
 Thread.getname = getname
 
+-- per thread name histograms of the slice runtimes and of the time spent
+-- in the run queues between being woken up and actually running
+local runtime_histograms = {}
+local wakeup_histograms = {}
+local function record (histograms, name, time)
+  local h = histograms[name]
+  if not h then h = Histogram:new() histograms[name] = h end
+  h:record(time)
+end
+
 local total_runtime = 0
 local function add_runtime (thd, time)
   thd = thread_names[thd]
+  record(runtime_histograms, thd, time)
   if time > (thread_latencies[thd] or 0) then thread_latencies[thd] = time end
   thread_runtimes[thd] = (thread_runtimes[thd] or 0) + time
   total_runtime = total_runtime + time
 end
 
+local thread_waits = {}
+local thread_max_waits = {}
+local function add_wait (thd, time)
+  thd = thread_names[thd]
+  record(wakeup_histograms, thd, time)
+  if time > (thread_max_waits[thd] or 0) then thread_max_waits[thd] = time end
+  thread_waits[thd] = (thread_waits[thd] or 0) + time
+end
+
 Thread.thread_timing_info = function ()
   local latencies = thread_latencies
   thread_latencies = {}
   return total_runtime, thread_runtimes, latencies
 end
 
+-- Returns a table mapping thread names to `{ runtime = ..., wakeup = ... }`
+-- histogram summaries (in milliseconds, see `Histogram:summary`). Starts
+-- collecting new histograms if `reset` is true.
+function Thread.latency_info (reset)
+  local info = {}
+  for name,h in pairs(runtime_histograms) do
+    info[name] = { runtime = h:summary(1000) }
+  end
+  for name,h in pairs(wakeup_histograms) do
+    local t = info[name] or {}
+    info[name] = t
+    t.wakeup = h:summary(1000)
+  end
+  if reset then
+    runtime_histograms = {}
+    wakeup_histograms = {}
+  end
+  return info
+end
+
 local function timing_sort(tab)
   local r = {}
   for k, v in pairs(tab) do
@@ -116,35 +157,184 @@ Thread.thread_timing_report = function ()
     io.stderr:write(string.format("%6.2f ms %s\n", latency[i][2] * 1000, latency[i][1]))
   end
   io.stderr:write('\n')
+  local rq = Thread.runqueue_info()
+  local waits = timing_sort(rq.max_waits)
+  io.stderr:write(string.format("Highest run queue waits (max depth %d):\n", rq.max_depth))
+  for i=1,10 do
+    if not waits[i] then break end
+    io.stderr:write(string.format("%6.2f ms %s\n", waits[i][2] * 1000, waits[i][1]))
+  end
+  io.stderr:write('\n')
   io.stderr:write(string.format("Timing report time: %.2f ms\n", (Thread.now() - start) * 1000))
 end
 
+--
+-- FIFO queue with O(1) operations on both ends
+--
+local Fifo = {}
+Fifo.__index = Fifo
+Thread.Fifo = Fifo
+
+function Fifo.new ()
+  return setmetatable({ head = 1, tail = 0 }, Fifo)
+end
+
+function Fifo:len ()
+  return self.tail - self.head + 1
+end
+
+function Fifo:push (v)
+  local tail = self.tail + 1
+  self[tail] = v
+  self.tail = tail
+end
+
+function Fifo:pushfront (v)
+  local head = self.head - 1
+  self[head] = v
+  self.head = head
+end
+
+function Fifo:peek ()
+  return self[self.head]
+end
+
+function Fifo:pop ()
+  local head = self.head
+  local tail = self.tail
+  if head > tail then return nil end
+  local v = self[head]
+  self[head] = nil
+  if head == tail then
+    -- rewind the indices so an often drained queue never grows the table
+    self.head = 1 self.tail = 0
+  else
+    self.head = head + 1
+  end
+  return v
+end
+
+-- Removes the first occurrence of `v`, in O(n). Returns true if it was found.
+function Fifo:remove (v)
+  local tail = self.tail
+  for i=self.head,tail do
+    if self[i] == v then
+      for j=i,tail-1 do self[j] = self[j+1] end
+      self[tail] = nil
+      self.tail = tail - 1
+      return true
+    end
+  end
+  return false
+end
+
 local function get_mailbox (thd)
   local mbox = thread_mailboxes[thd]
-  if not mbox then mbox = {} thread_mailboxes[thd] = mbox end
+  if not mbox then mbox = Fifo.new() thread_mailboxes[thd] = mbox end
   return mbox
 end
 
-local busy_list = {}
+--
+-- Run queues
+--
+-- Runnable threads (freshly spawned ones and the ones which resumed another
+-- thread) wait in one FIFO queue per priority class. The scheduler always
+-- picks the oldest thread from the highest non-empty class.
+local PRIORITIES = { 'high', 'normal', 'low' }
+for i,name in ipairs(PRIORITIES) do PRIORITIES[name] = i end
+Thread.PRIORITIES = PRIORITIES
+local DEFAULT_PRIORITY = PRIORITIES.normal
+
+local run_queues = {}
+for i=1,#PRIORITIES do run_queues[i] = Fifo.new() end
+local thread_priorities = setmetatable ({}, weakmt)
+local queued_in = setmetatable ({}, weakmt)
+local queued_at = setmetatable ({}, weakmt)
+local runnable = 0
+local max_runnable = 0
+
+local function ready (thd)
+  if queued_in[thd] then return end
+  local prio = thread_priorities[thd] or DEFAULT_PRIORITY
+  run_queues[prio]:push(thd)
+  queued_in[thd] = prio
+  queued_at[thd] = Thread.now()
+  runnable = runnable + 1
+  if runnable > max_runnable then max_runnable = runnable end
+end
+
+local function next_ready (now)
+  if runnable == 0 then return nil end
+  for i=1,#run_queues do
+    local thd = run_queues[i]:pop()
+    if thd then
+      runnable = runnable - 1
+      add_wait (thd, now - queued_at[thd])
+      queued_in[thd] = nil
+      queued_at[thd] = nil
+      return thd
+    end
+  end
+end
+
+function Thread.setpriority (prio, thd)
+  checks('string', '?thread')
+  if not thd then thd = current() end
+  local i = PRIORITIES[prio]
+  if not i then error("setpriority: invalid priority class: "..prio, 2) end
+  thread_priorities[thd] = i
+  local queued = queued_in[thd]
+  if queued and queued ~= i then
+    -- rare enough for the linear search, and keeps each thread queued once
+    run_queues[queued]:remove(thd)
+    run_queues[i]:push(thd)
+    queued_in[thd] = i
+  end
+end
+
+function Thread.getpriority (thd)
+  checks('?thread')
+  if not thd then thd = current() end
+  return PRIORITIES[thread_priorities[thd] or DEFAULT_PRIORITY]
+end
+
+-- Returns the current and maximum run queue depths and the total and maximum
+-- time threads spent waiting in the queues (per thread name). The maximums
+-- are reset after each call.
+function Thread.runqueue_info ()
+  local depths = {}
+  for i,name in ipairs(PRIORITIES) do depths[name] = run_queues[i]:len() end
+  local info = {
+    depth = runnable,
+    depths = depths,
+    max_depth = max_runnable,
+    waits = thread_waits,
+    max_waits = thread_max_waits,
+  }
+  max_runnable = runnable
+  thread_max_waits = {}
+  return info
+end
+
 local callback_list = {}
 local nice_list = {}
 local Idle = { list = nice_list, call = function (f) assert(type(f) == 'function', 'function expected') nice_list[f] = true end }
-local handle_resume_result, resume
+local handle_resume_result, resume, run
 function handle_resume_result (thd, tstart, resume_ok, ...)
-  local tend = Thread.now()
-  add_runtime (thd, tend - tstart)
+  -- the end of this run is the start of the next one
+  local now = Thread.now()
+  add_runtime (thd, now - tstart)
   if not resume_ok then
     report_error(thd, ...)
   elseif ... then
-    return resume(...) -- trampoline
+    return run(now, ...) -- trampoline
   end
   local idle = false
   while not idle do
     idle = true
-    local busy_thd = next(busy_list)
+    local busy_thd = next_ready(now)
     if busy_thd then
-      busy_list[busy_thd] = nil
-      return resume(busy_thd)
+      return run(now, busy_thd)
     end
     if #callback_list > 0 then
       idle = false
@@ -175,24 +365,29 @@ function handle_resume_result (thd, tstart, resume_ok, ...)
       end
     end
     current_thread = 'thread:       main'
+    if not idle then now = Thread.now() end
   end
 end
 local main_thread_resume_arguments
+-- Runs `thd` from outside of any thread, `tstart` is the current time.
+function run (tstart, thd, ...)
+  current_thread = thd
+  if thd == 'thread:       main' then
+    -- io.stderr:write('Thread.loop_stop() not cthd\n')
+    main_thread_resume_arguments = {...}
+    return Thread.loop_stop()
+  else
+    return handle_resume_result (thd, tstart, oldresume (thd, ...))
+  end
+end
 function resume (thd, ...)
   local cthd = oldcurrent()
   -- print("resume", cthd, thd, (...))
   if not cthd then
-    current_thread = thd
-    if thd == 'thread:       main' then
-      -- io.stderr:write('Thread.loop_stop() not cthd\n')
-      main_thread_resume_arguments = {...}
-      return Thread.loop_stop()
-    else
-      return handle_resume_result (thd, Thread.now(), oldresume (thd, ...))
-    end
+    return run (Thread.now(), thd, ...)
   else
     if cthd == thd then error('a thread cannot resume itself', 2) end
-    busy_list[current()] = true
+    ready(current())
     if thd == 'thread:       main' then
       -- print('Thread.loop_stop() cthd', current())
       main_thread_resume_arguments = {...}
@@ -259,7 +454,7 @@ function Thread.go (fun, ...)
     end
     thd = create (fun)
     setname(src, thd)
-    busy_list[thd] = true
+    ready(thd)
   end
   return thd
 end
@@ -341,8 +536,8 @@ ThreadMailbox.__type = "ThreadMailbox"
 function ThreadMailbox.poll (_)
   local thd = current()
   local mbox = thread_mailboxes[thd]
-  if mbox and #mbox > 0 then
-    return true, table.remove(mbox, 1)
+  if mbox and mbox.tail >= mbox.head then
+    return true, mbox:pop()
   end
   return false
 end
@@ -365,7 +560,7 @@ function Thread.send (thd, ...)
   if mbox.waiting then
     return resume (thd, ThreadMailbox, ...)
   else
-    mbox[#mbox + 1] = {...}
+    mbox:push({...})
   end
 end
 
@@ -410,14 +605,26 @@ function Source.recv (self)
   return recvone (self)
 end
 
+-- Granularity of `Thread.sleep` and `Thread.Timeout`. All timers expiring in
+-- the same tick share a single libev timer.
+Thread.TIMER_TICK = 0.001
+
 function Thread.install_loop (loop)
+  -- sleeping threads and Timeout objects are kept in a pool of native timers
+  -- so starting and cancelling them does not allocate any closures
+  local timers = require'timers'.new(Thread.TIMER_TICK, function (o)
+    if type(o) == 'thread' then
+      return resume(o, true)
+    else
+      return o:fire()
+    end
+  end, function (err) return report_error(nil, err) end)
+  Thread.timer_stats = function () return timers:stats() end
+
   function Thread.sleep (seconds)
-    local c = current()
-    local cancel = loop.run_after (seconds, function ()
-      return resume(c, true)
-    end)
+    local id = timers:add(seconds, current())
     local ok = yield()
-    if not ok then cancel() return yield() end
+    if not ok then timers:cancel(id) return yield() end
   end
 
   local ev = require'ev'
@@ -433,14 +640,8 @@ function Thread.install_loop (loop)
     self.time = seconds
     if seconds <= 0 then
       self:fire()
-    else
-      if self.timer then
-        self.timer(seconds)
-      else
-        self.timer = loop.run_after (seconds, function ()
-          self:fire()
-        end)
-      end
+    elseif not (self.timer and timers:restart(self.timer, seconds)) then
+      self.timer = timers:add(seconds, self)
     end
   end
 
@@ -457,7 +658,7 @@ function Thread.install_loop (loop)
 
   function Timeout:cancel()
     self.fired = nil
-    self.timer()
+    if self.timer then timers:cancel(self.timer) end
   end
 
   function Timeout:restart(time)
@@ -479,16 +680,62 @@ local Mailbox = Source:inherit()
 Thread.Mailbox = Mailbox
 Mailbox.__type = 'Mailbox'
 
-function Mailbox.init (self)
-  self.buffer = {}
+-- `capacity` limits the number of buffered messages. When the buffer is full
+-- `put` follows the `policy`: 'block' (the default) suspends the producer until
+-- a message is received, 'drop-oldest' and 'drop-newest' discard a message.
+local MAILBOX_POLICIES = { ['block'] = true, ['drop-oldest'] = true, ['drop-newest'] = true }
+
+function Mailbox.init (self, capacity, policy)
+  self.buffer = Fifo.new()
+  self.hwm = 0
+  self.dropped = 0
+  if capacity then
+    if type(capacity) ~= 'number' or capacity < 1 then error('invalid mailbox capacity: '..tostring(capacity), 3) end
+    policy = policy or 'block'
+    if not MAILBOX_POLICIES[policy] then error('invalid mailbox policy: '..tostring(policy), 3) end
+    self.capacity = capacity
+    self.policy = policy
+    self.writers = Fifo.new()
+    self.blocked = 0
+  end
   return self
 end
 
+function Mailbox._wait_writable (self)
+  if not oldcurrent() then error('you cannot block on a full Mailbox on the main thread', 3) end
+  local thd = current()
+  local writers = self.writers
+  writers:push(thd)
+  writers[thd] = true
+  self.blocked = self.blocked + 1
+  local ok = yield()
+  if ok == false then
+    writers[thd] = nil
+    return yield()
+  end
+end
+
 function Mailbox.put (self, ...)
   local n = #self
   if n == 0 then
     local buf = self.buffer
-    buf[#buf + 1] = {...}
+    local capacity = self.capacity
+    if capacity and buf:len() >= capacity then
+      local policy = self.policy
+      if policy == 'drop-newest' then
+        self.dropped = self.dropped + 1
+        return
+      elseif policy == 'drop-oldest' then
+        self.dropped = self.dropped + 1
+        buf:pop()
+      else
+        self:_wait_writable()
+        return self:put(...)
+      end
+    end
+    buf:push({...})
+    local depth = buf:len()
+    if depth > self.hwm then self.hwm = depth end
   else
     if n > 1 then
       n = math.random (#self)
@@ -500,7 +747,10 @@ end
 function Mailbox.putback (self, ...)
   local n = #self
   if n == 0 then
-    table.insert (self.buffer, 1, {...})
+    local buf = self.buffer
+    buf:pushfront({...})
+    local depth = buf:len()
+    if depth > self.hwm then self.hwm = depth end
   else
     if n > 1 then
       n = math.random (#self)
@@ -510,13 +760,35 @@ function Mailbox.putback (self, ...)
 end
 
 function Mailbox.poll (self)
-  local buf = self.buffer
-  if #buf > 0 then
-    return true, table.remove (buf, 1)
+  local v = self.buffer:pop()
+  if v then
+    local writers = self.writers
+    if writers then
+      while true do
+        local thd = writers:pop()
+        if not thd then break end
+        if writers[thd] then
+          writers[thd] = nil
+          ready(thd)
+          break
+        end
+      end
+    end
+    return true, v
   end
   return false
 end
 
+function Mailbox.stats (self)
+  return {
+    depth = self.buffer:len(),
+    hwm = self.hwm,
+    capacity = self.capacity,
+    dropped = self.dropped,
+    blocked = self.blocked,
+  }
+end
+
 local function apply (mbox, fun, ...)
   if mbox then
     return mbox:put(Thread.pcall(fun, ...))
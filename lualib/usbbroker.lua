@@ -0,0 +1,172 @@
+local T = require'thread'
+local B = require'binary'
+local D = require'util'
+local loop = require'loop'
+local ExtProc = require'extproc'
+local F = require'extframing'
+local o = require'kvo'
+
+-- A single `usb-broker` process serving all the sepack devices of this
+-- process over one connection, instead of a `raw-usb` process per device.
+-- Every `UsbBrokerLink` is a logical stream of that connection (see
+-- `usb-broker.lua` for the protocol). The broker is respawned when it exits,
+-- which drops all the devices at once; addresses which need the isolation of
+-- their own process keep using `ExtProc.newUsb`.
+local Broker = ExtProc:inherit{
+  framing = 'binary',
+  -- `usb-broker` only speaks over a socket (or stdio), whatever the
+  -- transport of the other external processes is
+  transport = 'tcp',
+}
+
+function Broker:init (args, _log)
+  self.links = {}
+  ExtProc.init(self, args, _log)
+end
+
+local shared
+
+-- the broker shared by all the links of this process
+function Broker.get (class, log)
+  if not shared then
+    local args = {os.executable_path..' :usb-broker', ExtProc.portno_token}
+    if class.usb_depth then args[#args+1] = '.d'..class.usb_depth end
+    if class.usb_transfer_size then args[#args+1] = '.z'..class.usb_transfer_size end
+    shared = class:new(args, log)
+  end
+  return shared
+end
+
+function Broker:_in_loop(infd)
+  -- `ExtProc._handle_connect` has switched the framing to binary by now, the
+  -- streams opened before (or in a previous broker) are opened again
+  for id,link in pairs(self.links) do self:_open(link) end
+  ExtProc._in_loop(self, infd)
+  -- the broker is gone together with all the devices
+  for id,link in pairs(self.links) do link:_handle_message(nil, 'disconnect') end
+end
+
+function Broker:_handle_message(data, cmd, stream)
+  local link = self.links[stream]
+  if link then return link:_handle_message(data, cmd) end
+  if cmd then self.log:error('unexpected broker message', cmd, stream) end
+end
+
+function Broker:_write(kind, data, stream)
+  if not (self.outfd and self.write_frame) then return end
+  self.tx_writes = self.tx_writes + 1
+  loop.writev(self.outfd, { self.write_frame(kind, data, stream, true) })
+end
+
+-- writes the data `transfers` of a stream with a single `writev`
+function Broker:_write_transfers(transfers, stream)
+  if not (self.outfd and self.write_frame) then return end
+  local out, n = {}, 0
+  local write_frame = self.write_frame
+  for i=1,#transfers do
+    out[n+1], out[n+2] = write_frame(F.DATA, transfers[i], stream, true)
+    n = n + 2
+  end
+  self.tx_writes = self.tx_writes + 1
+  loop.writev(self.outfd, out)
+end
+
+function Broker:_open(link)
+  self:_write(F.COMMAND, string.format('open %d %s %s', link.stream,
+    link.product or '-', link.serial_number or '-'), 0)
+end
+
+-- registers `link` on the first free stream
+function Broker:attach(link)
+  for id=1,255 do
+    if not self.links[id] then
+      self.links[id] = link
+      link.stream = id
+      return self:_open(link)
+    end
+  end
+  error('too many USB broker streams')
+end
+
+function Broker:detach(link)
+  if self.links[link.stream] ~= link then return end
+  self.links[link.stream] = nil
+  self:_write(F.COMMAND, 'close '..link.stream, 0)
+end
+
+-- One device served by the broker, with the same `inbox`, `outbox`, `status`
+-- and `serial` interface as `ExtProc.newUsb`.
+local UsbBrokerLink = ExtProc:inherit{}
+
+function UsbBrokerLink:init (broker, product, serial, _log)
+  self.log = _log or log.null
+  self.broker = broker
+  self.product = product
+  self.serial_number = serial
+
+  self.inbox = T.Mailbox:new(self.inbox_capacity, self.inbox_policy)
+  self.outbox = T.Mailbox:new()
+  self.status = o(false)
+  self.serial = o()
+  self.tx_packets = 0
+  self.tx_transfers = 0
+  self.tx_writes = 0
+  T.go(self._out_loop, self)
+  broker:attach(self)
+end
+
+function UsbBrokerLink.newUsb (class, product, serial, log)
+  return class:new(Broker:get(log), product, serial, log)
+end
+
+function UsbBrokerLink:_handle_message(data, cmd)
+  if cmd == 'disconnect' then
+    self.log:dbg('? disconnect')
+    self.status(false)
+    self.serial(nil)
+  else
+    return ExtProc._handle_message(self, data, cmd)
+  end
+end
+
+-- Releases the device and asks for it again, the broker counterpart of
+-- respawning `raw-usb`.
+function UsbBrokerLink:restart()
+  self.broker:detach(self)
+  self:_handle_message(nil, 'disconnect')
+  self.broker:attach(self)
+end
+
+function UsbBrokerLink:close()
+  self.broker:detach(self)
+  self.status(false)
+end
+
+function UsbBrokerLink:_send(transfers)
+  self.broker:_write_transfers(transfers, self.stream)
+  self.tx_transfers = self.tx_transfers + #transfers
+  self.tx_writes = self.tx_writes + 1
+end
+
+function UsbBrokerLink:_out_loop()
+  while true do
+    local data = self.outbox:recv()
+    if type(data) ~= 'string' then
+      self.log:err('error: unknown data format: '..D.repr(data))
+    elseif self.status() then
+      if self.coalesce then
+        local transfers = self:_coalesce(data)
+        -- the device may have gone while the packets were collected
+        if self.status() then self:_send(transfers) end
+      else
+        self.log:dbg('> '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
+        self.tx_packets = self.tx_packets + 1
+        self:_send{ data }
+      end
+    end
+  end
+end
+
+UsbBrokerLink.Broker = Broker
+
+return UsbBrokerLink
@@ -0,0 +1,187 @@
+local usb = require'usb'
+local T = require'thread'
+local B = require'binary'
+local D = require'util'
+local E = require'errno'
+local ExtProc = require'extproc'
+local SU = require'sepackusb'
+local o = require'kvo'
+
+-- An in-process alternative to `ExtProc.newUsb`: drives the sepack device
+-- directly from the main loop through the `usb` module instead of talking to
+-- a `raw-usb` subprocess over a socket. It offers the same `inbox`, `outbox`,
+-- `status` and `serial` interface (and reports the same status changes as
+-- `raw-usb.lua`), but a crash in the USB layer takes the whole process down.
+local UsbLink = ExtProc:inherit{
+  read_size = 2048,
+  -- number of bulk reads and writes kept in flight
+  read_depth = 4,
+  write_depth = 4,
+  -- the device is dropped after this many errors within a second
+  max_errors = 15,
+}
+
+function UsbLink:init (product, serial, _log)
+  self.log = _log or log.null
+  self.product = product
+  self.serial_number = serial
+
+  self.inbox = T.Mailbox:new(self.inbox_capacity, self.inbox_policy)
+  self.outbox = T.Mailbox:new()
+  self.status = o(false)
+  self.serial = o()
+  self.tx_packets = 0
+  self.tx_transfers = 0
+  self.tx_writes = 0
+  self.errors = SU.ErrorRate:new(self.max_errors)
+  T.go(self._out_loop, self)
+  T.go(self._watch, self)
+end
+
+function UsbLink.newUsb (class, product, serial, log)
+  return class:new(product, serial, log)
+end
+
+function UsbLink:_watch()
+  local found
+  self.status(true)
+  self.watcher = usb.watch{
+    idVendor = '16d0',
+    idProduct = '0450',
+    bcdDevice = '0100',
+
+    connect = function (d)
+      if self.product and d.product ~= self.product then return end
+      if self.serial_number and d.serial ~= self.serial_number then return end
+      if self.dev then return end
+      local ok, status = T.spcall(self._open_device, self, d)
+      if not ok then
+        self.log:error('open_device', D.unq(status))
+      elseif status then
+        found = true
+      end
+    end,
+    disconnect = function (d)
+      if d == self.dev then self:_drop() end
+    end,
+    coldplug_end = function ()
+      if not found then
+        self.status('coldplug-end')
+        self.serial(nil)
+      end
+    end,
+  }
+end
+
+function UsbLink:_open_device(d)
+  local pin, pout = SU.open(d, {
+    read_depth = self.read_depth,
+    read_size = self.read_size,
+    write_depth = self.write_depth,
+    log = function (msg) self.log:error(msg) end,
+  })
+  if not pin then
+    self.log:warn('device busy', d.product, d.serial)
+    return
+  end
+  self.dev = d
+  self.pin = pin
+  self.pout = pout
+  self.errors = SU.ErrorRate:new(self.max_errors)
+  self.status('connect')
+  self.serial(d.serial)
+  self:_start_reads()
+  return true
+end
+
+function UsbLink:_start_reads()
+  local pin = self.pin
+  SU.start_reads(pin, {
+    read_depth = self.read_depth,
+    read_size = self.read_size,
+    active = function () return self.pin == pin end,
+    data = function (data)
+      self.log:dbg('< '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
+      self.inbox:put(data)
+    end,
+    error = function (err, fatal, errno)
+      self:_handle_error("usb read", err, fatal, errno)
+    end,
+  })
+end
+
+function UsbLink:_handle_error(msg, err, fatal, errno)
+  if SU.disconnected(errno) then
+    self.log:dbg('< disconnected')
+    return self:_drop()
+  end
+  local errc = E[errno]
+  self.log:error(msg, err, errc, usb.fmt_errno(errno))
+  if self.errors:put(msg) then
+    self.log:error('giving up after too many errors')
+    return self:_drop(true)
+  end
+end
+
+-- Closes the current device. It is picked up again on the next hotplug event,
+-- or after `respawn_period` if `reopen` is set (which is what respawning
+-- `raw-usb` used to achieve).
+function UsbLink:_drop(reopen)
+  local dev = self.dev
+  if not dev then return end
+  if self.pin.stop_reading then self.pin:stop_reading() end
+  self.dev, self.pin, self.pout = nil, nil, nil
+  if dev.wrwatch_stop then dev.wrwatch_stop() end
+  T.spcall(dev.close, dev)
+  self.status(false)
+  self.serial(nil)
+  if reopen then
+    T.go(function ()
+      T.sleep(self.respawn_period)
+      if self.dev then return end
+      local ok, err = T.spcall(self._open_device, self, dev)
+      if not ok then self.log:error('open_device', D.unq(err)) end
+    end)
+  end
+end
+
+-- URB statistics of the bulk endpoints (where the usb module provides them)
+function UsbLink:usb_stats()
+  if not self.pin or not self.pin.stats then return nil end
+  return { ['in'] = self.pin:stats(), out = self.pout:stats() }
+end
+
+function UsbLink:restart()
+  self:_drop(true)
+end
+
+function UsbLink:_send(transfers)
+  local pout = self.pout
+  for i=1,#transfers do
+    pout:write(transfers[i], function (ok, err, fatal, errno)
+      if not ok then self:_handle_error("usb write", err, fatal, errno) end
+    end)
+  end
+  self.tx_transfers = self.tx_transfers + #transfers
+end
+
+function UsbLink:_out_loop()
+  while true do
+    local data = self.outbox:recv()
+    if type(data) ~= 'string' then
+      self.log:err('error: unknown data format: '..D.repr(data))
+    elseif self.pout then
+      if self.coalesce then
+        local transfers = self:_coalesce(data)
+        -- the device may have gone while the packets were collected
+        if self.pout then self:_send(transfers) end
+      else
+        self.log:dbg('> '..string.format('%s : %s', B.bin2hex(data), D.repr(data)))
+        self.tx_packets = self.tx_packets + 1
+        self:_send{ data }
+      end
+    end
+  end
+end
+
+return UsbLink
@@ -300,15 +300,26 @@ end
 
 
 
--- log tracebacks
-local thread_error_log = log:sub('thread')
+-- log tracebacks (and the latencies, see below)
+local thread_log = log:sub('thread')
 local old_thread_error_handler
 old_thread_error_handler = T.sethandler('default', function (thd, err)
-  thread_error_log:struct('error', thread_error_log.format_traceback_struct(err, thd))
+  thread_log:struct('error', thread_log.format_traceback_struct(err, thd))
   if io.isatty(2) then old_thread_error_handler(thd, err) end
   os.exit(2)
 end)
 
+-- periodically log the per thread latency histograms (see `T.latency_info`)
+function M.log_thread_latencies(period)
+  checks('?number')
+  return T.go(function ()
+    while true do
+      T.sleep(period or 60)
+      thread_log:struct('latency', T.latency_info(true))
+    end
+  end)
+end
+
 
 
 M.prepend_timestamps = true
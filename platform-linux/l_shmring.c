@@ -0,0 +1,176 @@
+///
+/// Lua bindings of the shared memory transport (see shmring.c).
+///
+
+/// ## Necessary declarations
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "../common/LM.h"
+#include "../common/debug.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "shmring.h"
+#include "l_shmring.h"
+
+struct lua_shmring {
+  struct shmring *r;
+};
+
+static const char *lua_shmring_mt = "<shmring>";
+
+static struct shmring *check_shmring (lua_State *L, int i)
+{
+  struct lua_shmring *lr = luaL_checkudata (L, i, lua_shmring_mt);
+  if (!lr->r) luaL_argerror (L, i, "closed shmring");
+  return lr->r;
+}
+
+static int push_shmring (lua_State *L, struct shmring *r, const char *name)
+{
+  if (!r) return luaLM_posix_error (L, name);
+  struct lua_shmring *lr = luaLM_create_userdata (L, sizeof(struct lua_shmring), lua_shmring_mt);
+  lr->r = r;
+  return 1;
+}
+
+//### constructors
+
+/// `shmring.new(size)` creates a ring pair with (at least) `size` bytes in each direction.
+static int lua_shmring_new (lua_State *L)
+{
+  size_t size = luaL_optnumber (L, 1, 1 << 20);
+  return push_shmring (L, shmring_create (size), "shmring.new");
+}
+
+/// `shmring.attach(address)` opens the other end of a ring pair in a child process.
+static int lua_shmring_attach (lua_State *L)
+{
+  const char *address = luaL_checkstring (L, 1);
+  return push_shmring (L, shmring_attach (address), "shmring.attach");
+}
+
+//### methods
+
+/// `ring:address()` returns the string to be passed to the child process.
+static int lua_shmring_address (lua_State *L)
+{
+  lua_pushstring (L, shmring_address (check_shmring (L, 1)));
+  return 1;
+}
+
+/// `ring:close_remote()` closes the descriptors inherited by the child (after it is spawned).
+static int lua_shmring_close_remote (lua_State *L)
+{
+  shmring_close_remote (check_shmring (L, 1));
+  return 0;
+}
+
+/// `ring:getfd()` returns the doorbell descriptor (so the ring can be passed to
+/// `loop.on_readable`).
+static int lua_shmring_getfd (lua_State *L)
+{
+  lua_pushnumber (L, shmring_fd (check_shmring (L, 1)));
+  return 1;
+}
+
+/// `ring:send(data, type = 1)` returns `true`, or `nil, "full"` when there is not enough space in
+/// the ring.
+static int lua_shmring_send (lua_State *L)
+{
+  struct shmring *r = check_shmring (L, 1);
+  size_t len;
+  const char *s = luaL_checklstring (L, 2, &len);
+  int type = luaL_optinteger (L, 3, 1);
+  luaL_argcheck (L, type >= 0 && type <= 255, 3, "invalid message type");
+  if (shmring_send (r, type, s, len) < 0) {
+    if (errno == EAGAIN) {
+      lua_pushnil (L);
+      lua_pushliteral (L, "full");
+      return 2;
+    }
+    return luaLM_posix_error (L, "shmring.send");
+  }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+/// `ring:recv()` returns the data and the type of the next message or nothing if the ring is
+/// empty.
+static int lua_shmring_recv (lua_State *L)
+{
+  struct shmring *r = check_shmring (L, 1);
+  struct shmring_msg m;
+  int ret = shmring_peek (r, &m);
+  if (ret < 0) return luaLM_posix_error (L, "shmring.recv");
+  if (ret == 0) return 0;
+  lua_pushlstring (L, (const char *)m.seg[0], m.seglen[0]);
+  if (m.seglen[1]) {
+    lua_pushlstring (L, (const char *)m.seg[1], m.seglen[1]);
+    lua_concat (L, 2);
+  }
+  lua_pushnumber (L, m.type);
+  shmring_consume (r, &m);
+  return 2;
+}
+
+/// `ring:clear()` resets the doorbell, it returns `nil, "eof"` when the other process is gone.
+static int lua_shmring_clear (lua_State *L)
+{
+  if (shmring_clear_bell (check_shmring (L, 1)) < 0) {
+    if (errno == EPIPE) {
+      lua_pushnil (L);
+      lua_pushliteral (L, "eof");
+      return 2;
+    }
+    return luaLM_posix_error (L, "shmring.clear");
+  }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int lua_shmring_close (lua_State *L)
+{
+  struct lua_shmring *lr = luaL_checkudata (L, 1, lua_shmring_mt);
+  if (lr->r) shmring_close (lr->r);
+  lr->r = NULL;
+  return 0;
+}
+
+static int lua_shmring__tostring (lua_State *L)
+{
+  struct lua_shmring *lr = luaL_checkudata (L, 1, lua_shmring_mt);
+  lua_pushfstring (L, "<shmring %s>", lr->r ? shmring_address (lr->r) : "closed");
+  return 1;
+}
+
+//###
+
+static const struct luaL_reg functions[] = {
+  {"new",          lua_shmring_new          },
+  {"attach",       lua_shmring_attach       },
+  {NULL,           NULL                     },
+};
+
+static const struct luaL_reg shmring_methods[] = {
+  {"address",      lua_shmring_address      },
+  {"close_remote", lua_shmring_close_remote },
+  {"getfd",        lua_shmring_getfd        },
+  {"send",         lua_shmring_send         },
+  {"recv",         lua_shmring_recv         },
+  {"clear",        lua_shmring_clear        },
+  {"close",        lua_shmring_close        },
+  {"__tostring",   lua_shmring__tostring    },
+  {"__gc",         lua_shmring_close        },
+  {NULL,           NULL                     },
+};
+
+int luaopen_shmring (lua_State *L)
+{
+  luaLM_register_metatable (L, lua_shmring_mt, shmring_methods);
+  lua_newtable (L);
+  luaL_register (L, NULL, functions);
+  return 1;
+}
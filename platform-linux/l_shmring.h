@@ -0,0 +1,6 @@
+#ifndef L_SHMRING_H
+#define L_SHMRING_H
+
+int luaopen_shmring(lua_State *L);
+
+#endif
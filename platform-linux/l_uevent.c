@@ -0,0 +1,236 @@
+///
+/// A kernel uevent monitor which filters the events in C.
+///
+/// `usb.watch` only cares about a handful of devices but the kernel broadcasts the events of all
+/// of them. This monitor reads the netlink socket directly and drops the events which do not
+/// match its subsystem, device type and `PRODUCT` (vendor id, product id and bcdDevice) filters
+/// without creating any Lua value, so unrelated devices cost a `recv` and a few string
+/// comparisons instead of a `udev_device` and some sysfs reads.
+///
+
+/// ## Necessary declarations
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "../common/LM.h"
+#include "../common/debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "l_uevent.h"
+
+// see UEVENT_BUFFER_SIZE in the kernel
+#define UEVENT_BUFFER_SIZE 2048
+#define UEVENT_GROUP_KERNEL 1
+
+struct uevent_monitor {
+  int fd;
+  char subsystem[32];
+  char devtype[32];
+  long product[3]; // idVendor, idProduct, bcdDevice or -1
+  unsigned long received, matched, overruns;
+};
+
+static const char *uevent_monitor_mt = "<uevent.monitor>";
+
+static struct uevent_monitor *check_monitor (lua_State *L, int i)
+{
+  struct uevent_monitor *m = luaL_checkudata (L, i, uevent_monitor_mt);
+  if (m->fd < 0) luaL_argerror (L, i, "closed monitor");
+  return m;
+}
+
+//### filtering
+
+static const char *product_keys[3] = { "idVendor", "idProduct", "bcdDevice" };
+
+/// Parses the `PRODUCT=<vendor>/<product>/<bcdDevice>` value of an usb_device event (hexadecimal
+/// numbers without leading zeroes) and compares it with the filter.
+static int product_matches (struct uevent_monitor *m, const char *s)
+{
+  for (int i = 0; i < 3; i++) {
+    char *end;
+    long v = strtol (s, &end, 16);
+    if (end == s || (*end != '/' && *end != 0)) return 0;
+    if (m->product[i] >= 0 && v != m->product[i]) return 0;
+    s = *end ? end + 1 : end;
+  }
+  return 1;
+}
+
+/// Returns 1 if the event in `buf` (the "action@devpath" header followed by KEY=value strings)
+/// passes the filters and sets `action` and `devpath` to point into it.
+static int event_matches (struct uevent_monitor *m, const char *buf, size_t len,
+                          const char **action, const char **devpath)
+{
+  const char *subsystem = NULL, *devtype = NULL, *product = NULL;
+  *action = *devpath = NULL;
+  for (size_t i = strlen (buf) + 1; i < len; i += strlen (buf + i) + 1) {
+    const char *s = buf + i;
+    if (!strncmp (s, "ACTION=", 7)) *action = s + 7;
+    else if (!strncmp (s, "DEVPATH=", 8)) *devpath = s + 8;
+    else if (!strncmp (s, "SUBSYSTEM=", 10)) subsystem = s + 10;
+    else if (!strncmp (s, "DEVTYPE=", 8)) devtype = s + 8;
+    else if (!strncmp (s, "PRODUCT=", 8)) product = s + 8;
+  }
+  if (!*action || !*devpath) return 0;
+  if (m->subsystem[0] && (!subsystem || strcmp (subsystem, m->subsystem))) return 0;
+  if (m->devtype[0] && (!devtype || strcmp (devtype, m->devtype))) return 0;
+  if (m->product[0] >= 0 || m->product[1] >= 0 || m->product[2] >= 0) {
+    if (!product || !product_matches (m, product)) return 0;
+  }
+  return 1;
+}
+
+//### constructor
+
+static void opt_field (lua_State *L, const char *key, char *dst, size_t size)
+{
+  lua_getfield (L, 1, key);
+  const char *s = lua_tostring (L, -1);
+  if (s) {
+    if (strlen (s) >= size) luaL_error (L, "uevent.monitor: %s too long", key);
+    strcpy (dst, s);
+  }
+  lua_pop (L, 1);
+}
+
+/// `uevent.monitor{ subsystem, devtype, idVendor, idProduct, bcdDevice, rcvbuf }` listens to
+/// the kernel uevents. The ids are hexadecimal strings (as in sysfs), the omitted filters match
+/// any event. `rcvbuf` is the size of the socket receive buffer (1MB by default), events are lost
+/// when it overflows.
+static int lua_uevent_monitor (lua_State *L)
+{
+  luaL_checktype (L, 1, LUA_TTABLE);
+  struct uevent_monitor *m = luaLM_create_userdata (L, sizeof(struct uevent_monitor), uevent_monitor_mt);
+  memset (m, 0, sizeof(*m));
+  m->fd = -1;
+  opt_field (L, "subsystem", m->subsystem, sizeof(m->subsystem));
+  opt_field (L, "devtype", m->devtype, sizeof(m->devtype));
+  for (int i = 0; i < 3; i++) {
+    lua_getfield (L, 1, product_keys[i]);
+    const char *s = lua_tostring (L, -1);
+    m->product[i] = -1;
+    if (s) {
+      char *end;
+      m->product[i] = strtol (s, &end, 16);
+      if (end == s || *end || m->product[i] < 0) return luaL_error (L, "uevent.monitor: invalid %s", product_keys[i]);
+    }
+    lua_pop (L, 1);
+  }
+  lua_getfield (L, 1, "rcvbuf");
+  int rcvbuf = luaL_optinteger (L, -1, 1 << 20);
+  lua_pop (L, 1);
+
+  int fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0) return luaLM_posix_error (L, "uevent.monitor: socket");
+  struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = UEVENT_GROUP_KERNEL };
+  if (bind (fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close (fd);
+    errno = err;
+    return luaLM_posix_error (L, "uevent.monitor: bind");
+  }
+  // SO_RCVBUFFORCE needs CAP_NET_ADMIN, the plain one is capped by net.core.rmem_max
+  if (setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+    setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  m->fd = fd;
+  return 1;
+}
+
+//### methods
+
+/// `monitor:getfd()` returns the netlink socket (so the monitor can be passed to
+/// `loop.on_readable`).
+static int lua_uevent_getfd (lua_State *L)
+{
+  lua_pushnumber (L, check_monitor (L, 1)->fd);
+  return 1;
+}
+
+/// `monitor:receive()` returns the action and the sysfs path of the next matching event, or
+/// nothing when there are no more events to read. The events which do not match are consumed.
+static int lua_uevent_receive (lua_State *L)
+{
+  struct uevent_monitor *m = check_monitor (L, 1);
+  char buf[UEVENT_BUFFER_SIZE + 1];
+  while (1) {
+    struct sockaddr_nl from;
+    struct iovec iov = { buf, UEVENT_BUFFER_SIZE };
+    struct msghdr msg = { .msg_name = &from, .msg_namelen = sizeof(from), .msg_iov = &iov, .msg_iovlen = 1 };
+    ssize_t n = recvmsg (m->fd, &msg, MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 0;
+      if (errno == ENOBUFS) { m->overruns++; continue; }
+      return luaLM_posix_error (L, "uevent.receive");
+    }
+    // only the kernel may send on this group
+    if (from.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC)) continue;
+    buf[n] = 0;
+    m->received++;
+    const char *action, *devpath;
+    if (!event_matches (m, buf, n, &action, &devpath)) continue;
+    m->matched++;
+    lua_pushstring (L, action);
+    lua_pushfstring (L, "/sys%s", devpath);
+    return 2;
+  }
+}
+
+/// `monitor:stats()` returns the number of events received, the number of events which passed
+/// the filters and the number of times the receive buffer overflowed.
+static int lua_uevent_stats (lua_State *L)
+{
+  struct uevent_monitor *m = luaL_checkudata (L, 1, uevent_monitor_mt);
+  lua_pushnumber (L, m->received);
+  lua_pushnumber (L, m->matched);
+  lua_pushnumber (L, m->overruns);
+  return 3;
+}
+
+static int lua_uevent_close (lua_State *L)
+{
+  struct uevent_monitor *m = luaL_checkudata (L, 1, uevent_monitor_mt);
+  if (m->fd >= 0) close (m->fd);
+  m->fd = -1;
+  return 0;
+}
+
+static int lua_uevent__tostring (lua_State *L)
+{
+  struct uevent_monitor *m = luaL_checkudata (L, 1, uevent_monitor_mt);
+  lua_pushfstring (L, "<uevent.monitor %s/%s>", m->subsystem, m->devtype);
+  return 1;
+}
+
+//###
+
+static const struct luaL_reg functions[] = {
+  {"monitor",      lua_uevent_monitor       },
+  {NULL,           NULL                     },
+};
+
+static const struct luaL_reg monitor_methods[] = {
+  {"getfd",        lua_uevent_getfd         },
+  {"receive",      lua_uevent_receive       },
+  {"stats",        lua_uevent_stats         },
+  {"close",        lua_uevent_close         },
+  {"__tostring",   lua_uevent__tostring     },
+  {"__gc",         lua_uevent_close         },
+  {NULL,           NULL                     },
+};
+
+int luaopen_uevent (lua_State *L)
+{
+  luaLM_register_metatable (L, uevent_monitor_mt, monitor_methods);
+  lua_newtable (L);
+  luaL_register (L, NULL, functions);
+  return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef L_UEVENT_H
+#define L_UEVENT_H
+
+int luaopen_uevent(lua_State *L);
+
+#endif
@@ -8,14 +8,22 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+
+#include "../common/buffer.h"
+#include "../common/l_buffer.h"
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #define USBDEVFS_URB_TYPE_ISO              0
 #define USBDEVFS_URB_TYPE_INTERRUPT        1
 #define USBDEVFS_URB_TYPE_CONTROL          2
 #define USBDEVFS_URB_TYPE_BULK             3
 
+#define USBDEVFS_URB_ISO_ASAP              0x02
+#define USBDEVFS_MAX_ISO_PACKETS           128
+
 #define USBDEVFS_MAXDRIVERNAME 255
 
 struct usbdevfs_getdriver {
@@ -76,6 +84,268 @@ static int _simple_ioctl(lua_State *L, int fd, int code, void *arg, const char *
     : (lua_pushboolean (L, 1), 1);
 }
 
+//### URB pool
+
+/// Endpoints keep a pool of URBs and page aligned transfer buffers which are recycled when the
+/// URBs are reaped, so steady streaming does not allocate. A slot in flight holds a (strong)
+/// reference to its pool.
+///
+/// Pools created with the device descriptor take their buffers from `mmap` on the usbfs file
+/// (Linux 4.6 and later). The kernel then does DMA straight into that memory instead of copying
+/// the data from and to a buffer of its own. Without usbfs `mmap` support the pool falls back
+/// to ordinary memory.
+struct urb_slot {
+  struct usbdevfs_urb urb; // has to be first, the kernel gives us back a pointer to it on reap
+  struct urb_pool *pool;
+  struct urb_slot *next;
+  void *buf;
+  size_t cap;
+  int mapped; // buf comes from usbfs mmap
+  int view;   // IN data is returned as a view into buf (see reap_urb)
+};
+
+struct urb_pool {
+  struct urb_slot *free;
+  size_t bufsize;
+  int fd;     // usbfs descriptor for mmap (or -1)
+  int closed; // collected, slots still held by views are freed on release
+  unsigned allocated;
+  unsigned reused;
+  unsigned inflight;
+  unsigned mapped;
+};
+
+static const char *urb_pool_mt = "<usb.pool>";
+static const char *urb_view_mt = "<usb.view>";
+
+static size_t page_round (size_t n)
+{
+  size_t pagesize = sysconf (_SC_PAGESIZE);
+  return (n + pagesize - 1) & ~(pagesize - 1);
+}
+
+static void *pool_alloc_buf (struct urb_pool *p, size_t cap, int *mapped)
+{
+  void *buf;
+  if (p->fd >= 0) {
+    buf = mmap (NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+    if (buf != MAP_FAILED) {
+      *mapped = 1;
+      p->mapped++;
+      return buf;
+    }
+    // no usbfs mmap (older kernel) or out of DMA memory: stay with ordinary memory from now on
+    p->fd = -1;
+  }
+  *mapped = 0;
+  if (posix_memalign (&buf, sysconf (_SC_PAGESIZE), cap)) return NULL;
+  return buf;
+}
+
+static void slot_free_buf (struct urb_pool *p, struct urb_slot *s)
+{
+  if (s->mapped) {
+    munmap (s->buf, s->cap);
+    p->mapped--;
+  } else {
+    free (s->buf);
+  }
+  s->buf = NULL;
+  s->cap = 0;
+  s->mapped = 0;
+}
+
+static struct urb_slot *pool_get (struct urb_pool *p, size_t n)
+{
+  struct urb_slot *s = p->free;
+  if (s) {
+    p->free = s->next;
+    p->reused++;
+  } else {
+    s = calloc (1, sizeof(struct urb_slot));
+    if (!s) return NULL;
+    s->pool = p;
+    p->allocated++;
+  }
+  if (n > s->cap) {
+    size_t cap = page_round (n > p->bufsize ? n : p->bufsize);
+    int mapped;
+    void *buf = pool_alloc_buf (p, cap, &mapped);
+    if (!buf) {
+      s->next = p->free;
+      p->free = s;
+      return NULL;
+    }
+    slot_free_buf (p, s);
+    s->buf = buf;
+    s->cap = cap;
+    s->mapped = mapped;
+  }
+  memset (&s->urb, 0, sizeof(struct usbdevfs_urb));
+  s->view = 0;
+  // distinguishes pool slots from standalone URBs (see reap_urb)
+  s->urb.usercontext = &s->pool;
+  p->inflight++;
+  return s;
+}
+
+/// Gives a reaped slot back to its pool (or frees it when the pool is gone).
+static void slot_release (struct urb_slot *s)
+{
+  struct urb_pool *p = s->pool;
+  if (p->closed) {
+    slot_free_buf (p, s);
+    free (s);
+    return;
+  }
+  s->next = p->free;
+  p->free = s;
+}
+
+static void pool_put (lua_State *L, struct urb_slot *s)
+{
+  struct urb_pool *p = s->pool;
+  luaLM_unregister_strong_proxy (L, &s->urb);
+  slot_release (s);
+  p->inflight--;
+  luaLM_unregister_strong_proxy (L, &s->pool);
+}
+
+/// `_usb.pool(bufsize = 4096, fd)` creates an URB pool, `bufsize` is the minimum size of the
+/// transfer buffers. With the usbfs descriptor `fd` the buffers are mapped from the device
+/// where the kernel supports it.
+static int pool_new (lua_State *L)
+{
+  size_t bufsize = luaL_optnumber (L, 1, 4096);
+  int fd = lua_isnoneornil (L, 2) ? -1 : luaLM_checkfd (L, 2);
+  struct urb_pool *p = luaLM_create_userdata (L, sizeof(struct urb_pool), urb_pool_mt);
+  p->bufsize = bufsize;
+  p->fd = fd;
+  return 1;
+}
+
+/// `pool:stats()` returns the number of allocated slots, of reused slots, of slots in flight
+/// and of buffers mapped from usbfs.
+static int pool_stats (lua_State *L)
+{
+  struct urb_pool *p = luaL_checkudata (L, 1, urb_pool_mt);
+  lua_pushnumber (L, p->allocated);
+  lua_pushnumber (L, p->reused);
+  lua_pushnumber (L, p->inflight);
+  lua_pushnumber (L, p->mapped);
+  return 4;
+}
+
+static int pool_gc (lua_State *L)
+{
+  struct urb_pool *p = luaL_checkudata (L, 1, urb_pool_mt);
+  while (p->free) {
+    struct urb_slot *s = p->free;
+    p->free = s->next;
+    slot_free_buf (p, s);
+    free (s);
+  }
+  p->closed = 1;
+  return 0;
+}
+
+static struct urb_pool *opt_pool (lua_State *L, int i)
+{
+  if (lua_isnoneornil (L, i)) return NULL;
+  return luaL_checkudata (L, i, urb_pool_mt);
+}
+
+static const struct luaL_reg pool_methods[] = {
+  { "stats",              pool_stats        },
+  { "__gc",               pool_gc           },
+  { NULL,                 NULL              },
+};
+
+//### views
+
+/// Received data returned without copying: the view holds on to the transfer buffer of its URB
+/// slot, which goes back to the pool on `view:release()` (or when the view is collected). The
+/// environment of the view keeps the pool alive.
+struct urb_view {
+  struct urb_slot *slot;
+  size_t len;
+};
+
+/// Pushes a view of the data received into the slot. The pool has to be on top of the stack.
+static void push_view (lua_State *L, struct urb_slot *s, size_t len)
+{
+  struct urb_view *v = luaLM_create_userdata (L, sizeof(struct urb_view), urb_view_mt);
+  v->slot = s;
+  v->len = len;
+  lua_createtable (L, 1, 0);
+  lua_pushvalue (L, -3);
+  lua_rawseti (L, -2, 1);
+  lua_setfenv (L, -2);
+}
+
+static struct urb_view *check_view (lua_State *L)
+{
+  struct urb_view *v = luaL_checkudata (L, 1, urb_view_mt);
+  if (!v->slot) luaL_error (L, "the view has been released");
+  return v;
+}
+
+/// `view:get([i [, j]])` copies the data (or bytes `i` to `j`) into a string.
+static int view_get (lua_State *L)
+{
+  struct urb_view *v = check_view (L);
+  size_t end = v->len, off = 0;
+  if (lua_isnumber (L, 3)) {
+    size_t e = lua_tonumber (L, 3);
+    if (e < end) end = e;
+  }
+  if (lua_isnumber (L, 2)) {
+    off = lua_tonumber (L, 2) - 1;
+    if (off > end) off = end;
+  }
+  lua_pushlstring (L, (char *)v->slot->buf + off, end - off);
+  return 1;
+}
+
+/// `view:write_to(buffer)` appends the data to a `buffer`.
+static int view_write_to (lua_State *L)
+{
+  struct urb_view *v = check_view (L);
+  struct buffer *b = luaL_checkudata (L, 2, lua_buffer_mt);
+  if (!buffer_write (b, v->slot->buf, v->len))
+    return luaL_error (L, "could not allocate %d bytes", (int)v->len);
+  return 0;
+}
+
+static int view_len (lua_State *L)
+{
+  struct urb_view *v = luaL_checkudata (L, 1, urb_view_mt);
+  lua_pushnumber (L, v->len);
+  return 1;
+}
+
+/// `view:release()` gives the buffer back to the pool right away, the view can not be used
+/// afterwards.
+static int view_release (lua_State *L)
+{
+  struct urb_view *v = luaL_checkudata (L, 1, urb_view_mt);
+  if (v->slot) slot_release (v->slot);
+  v->slot = NULL;
+  v->len = 0;
+  return 0;
+}
+
+static const struct luaL_reg view_methods[] = {
+  { "get",                view_get          },
+  { "write_to",           view_write_to     },
+  { "release",            view_release      },
+  { "__len",              view_len          },
+  { "__gc",               view_release      },
+  { NULL,                 NULL              },
+};
+
+//### requests
+
 static int set_configuration (lua_State *L)
 {
   int fd = luaLM_checkfd (L, 1);
@@ -131,53 +401,297 @@ static int disconnect_kernel (lua_State *L)
   return _simple_ioctl(L, fd, USBDEVFS_IOCTL, &cmd, __FUNCTION__);
 }
 
-static int bulk_write (lua_State *L)
+/// `_usb.bulk_write(fd, ep, data, pool)` submits a bulk OUT URB (taken from `pool` if given) which
+/// points directly into the `data` string. Returns the token passed back by `reap_urb`.
+static int submit_write (lua_State *L, unsigned char type, const char *name)
 {
   int fd = luaLM_checkfd (L, 1);
   int ep = luaL_checknumber (L, 2);
   size_t n = 0;
   const char *s = luaL_checklstring (L, 3, &n);
+  struct urb_pool *p = opt_pool (L, 4);
+  if (p) {
+    // mapped buffers are used for the data unless it is longer (then the kernel copies it)
+    struct urb_slot *slot = pool_get (p, p->fd >= 0 && n <= p->bufsize ? n : 0);
+    if (!slot) return luaL_error (L, "could not allocate the URB struct");
+    struct usbdevfs_urb *urb = &slot->urb;
+    urb->type = type;
+    urb->endpoint = ep;
+    if (slot->mapped && n <= slot->cap) {
+      memcpy (slot->buf, s, n);
+      urb->buffer = slot->buf;
+    } else {
+      urb->buffer = (char *)s;
+    }
+    urb->buffer_length = n;
+    if (ioctl (fd, USBDEVFS_SUBMITURB, urb) < 0) {
+      int r = luaLM_posix_error (L, name);
+      slot->next = p->free; p->free = slot; p->inflight--;
+      return r;
+    }
+    if (urb->buffer == s) luaLM_register_strong_proxy (L, urb, 3);
+    luaLM_register_strong_proxy (L, &slot->pool, 4);
+    lua_pushlightuserdata (L, urb->usercontext);
+    return 1;
+  }
   struct usbdevfs_urb *urb = malloc (sizeof(struct usbdevfs_urb));
   if (!urb) return luaL_error (L, "could not allocate the URB struct");
   memset (urb, 0, sizeof(struct usbdevfs_urb));
   urb->usercontext = urb;
-  urb->type = USBDEVFS_URB_TYPE_BULK;
+  urb->type = type;
   urb->endpoint = ep;
   urb->buffer = (char *)s;
   urb->buffer_length = n;
   luaLM_register_strong_proxy (L, urb, 3);
-  return _ioctl(L, fd, USBDEVFS_SUBMITURB, urb, __FUNCTION__)
+  return _ioctl(L, fd, USBDEVFS_SUBMITURB, urb, name)
     | (lua_pushlightuserdata (L, urb), 1);
 }
 
-static int bulk_read (lua_State *L)
+/// `_usb.bulk_read(fd, ep, n, pool, dst)` submits a bulk IN URB for `n` bytes (taken from `pool` if
+/// given). With a `dst` buffer the received data is appended to it on reap instead of being
+/// returned as a string, with `dst == true` it is returned as a view (see `view:get`).
+static int submit_read (lua_State *L, unsigned char type, const char *name)
 {
   int fd = luaLM_checkfd (L, 1);
   int ep = luaL_checknumber (L, 2);
   size_t n = luaL_checknumber (L, 3);
+  struct urb_pool *p = opt_pool (L, 4);
+  if (p) {
+    int view = lua_isboolean (L, 5) && lua_toboolean (L, 5);
+    if (!view && !lua_isnoneornil (L, 5)) luaL_checkudata (L, 5, lua_buffer_mt);
+    struct urb_slot *slot = pool_get (p, n);
+    if (!slot) return luaL_error (L, "could not allocate %d bytes", (int)n);
+    struct usbdevfs_urb *urb = &slot->urb;
+    urb->type = type;
+    urb->endpoint = ep;
+    urb->buffer = slot->buf;
+    urb->buffer_length = n;
+    if (ioctl (fd, USBDEVFS_SUBMITURB, urb) < 0) {
+      int r = luaLM_posix_error (L, name);
+      slot->next = p->free; p->free = slot; p->inflight--;
+      return r;
+    }
+    slot->view = view;
+    if (!view && !lua_isnoneornil (L, 5)) luaLM_register_strong_proxy (L, urb, 5);
+    luaLM_register_strong_proxy (L, &slot->pool, 4);
+    lua_pushlightuserdata (L, urb->usercontext);
+    return 1;
+  }
   char *s = malloc (n);
   if (!s) return luaL_error (L, "could not allocate %s bytes", n);
   struct usbdevfs_urb *urb = malloc (sizeof(struct usbdevfs_urb));
   if (!urb) return luaL_error (L, "could not allocate the URB struct");
   memset (urb, 0, sizeof(struct usbdevfs_urb));
   urb->usercontext = urb;
-  urb->type = USBDEVFS_URB_TYPE_BULK;
+  urb->type = type;
   urb->endpoint = ep;
   urb->buffer = s;
   urb->buffer_length = n;
-  return _ioctl(L, fd, USBDEVFS_SUBMITURB, urb, __FUNCTION__)
+  return _ioctl(L, fd, USBDEVFS_SUBMITURB, urb, name)
     | (lua_pushlightuserdata (L, urb), 1);
 }
 
-static int reap_urb (lua_State *L)
+static int bulk_write (lua_State *L)
+{
+  return submit_write (L, USBDEVFS_URB_TYPE_BULK, "bulk_write");
+}
+
+static int bulk_read (lua_State *L)
+{
+  return submit_read (L, USBDEVFS_URB_TYPE_BULK, "bulk_read");
+}
+
+/// `_usb.interrupt_write(fd, ep, data, pool)` and `_usb.interrupt_read(fd, ep, n, pool, dst)`
+/// work like their bulk counterparts for interrupt endpoints.
+static int interrupt_write (lua_State *L)
+{
+  return submit_write (L, USBDEVFS_URB_TYPE_INTERRUPT, "interrupt_write");
+}
+
+static int interrupt_read (lua_State *L)
+{
+  return submit_read (L, USBDEVFS_URB_TYPE_INTERRUPT, "interrupt_read");
+}
+
+//### isochronous transfers
+
+static struct usbdevfs_urb *iso_urb_new (int ep, int packets)
+{
+  struct usbdevfs_urb *urb = calloc (1, sizeof(struct usbdevfs_urb)
+                                     + packets * sizeof(struct usbdevfs_iso_packet_desc));
+  if (!urb) return NULL;
+  urb->usercontext = urb;
+  urb->type = USBDEVFS_URB_TYPE_ISO;
+  urb->flags = USBDEVFS_URB_ISO_ASAP;
+  urb->endpoint = ep;
+  urb->number_of_packets = packets;
+  return urb;
+}
+
+/// `_usb.iso_write(fd, ep, data, packet_size)` submits an isochronous OUT URB sending `data` in
+/// packets of `packet_size` bytes (one per (micro)frame, the last one may be shorter).
+static int iso_write (lua_State *L)
 {
   int fd = luaLM_checkfd (L, 1);
+  int ep = luaL_checknumber (L, 2);
+  size_t n = 0;
+  const char *s = luaL_checklstring (L, 3, &n);
+  size_t packet_size = luaL_checknumber (L, 4);
+  luaL_argcheck (L, packet_size > 0, 4, "invalid packet size");
+  int packets = n ? (n + packet_size - 1) / packet_size : 1;
+  luaL_argcheck (L, packets <= USBDEVFS_MAX_ISO_PACKETS, 3, "too many packets");
+  struct usbdevfs_urb *urb = iso_urb_new (ep, packets);
+  if (!urb) return luaL_error (L, "could not allocate the URB struct");
+  for (int i = 0; i < packets; i++)
+    urb->iso_frame_desc[i].length = i < packets - 1 ? packet_size : n - i * packet_size;
+  urb->buffer = (char *)s;
+  urb->buffer_length = n;
+  if (ioctl (fd, USBDEVFS_SUBMITURB, urb) < 0) {
+    free (urb);
+    return luaLM_posix_error (L, "iso_write");
+  }
+  luaLM_register_strong_proxy (L, urb, 3);
+  lua_pushlightuserdata (L, urb);
+  return 1;
+}
+
+/// `_usb.iso_read(fd, ep, packets, packet_size)` submits an isochronous IN URB for `packets`
+/// packets of up to `packet_size` bytes.
+static int iso_read (lua_State *L)
+{
+  int fd = luaLM_checkfd (L, 1);
+  int ep = luaL_checknumber (L, 2);
+  int packets = luaL_checknumber (L, 3);
+  size_t packet_size = luaL_checknumber (L, 4);
+  luaL_argcheck (L, packets > 0 && packets <= USBDEVFS_MAX_ISO_PACKETS, 3, "invalid number of packets");
+  luaL_argcheck (L, packet_size > 0, 4, "invalid packet size");
+  struct usbdevfs_urb *urb = iso_urb_new (ep, packets);
+  if (!urb) return luaL_error (L, "could not allocate the URB struct");
+  urb->buffer = malloc (packets * packet_size);
+  if (!urb->buffer) {
+    free (urb);
+    return luaL_error (L, "could not allocate %d bytes", (int)(packets * packet_size));
+  }
+  for (int i = 0; i < packets; i++) urb->iso_frame_desc[i].length = packet_size;
+  urb->buffer_length = packets * packet_size;
+  if (ioctl (fd, USBDEVFS_SUBMITURB, urb) < 0) {
+    free (urb->buffer);
+    free (urb);
+    return luaLM_posix_error (L, "iso_read");
+  }
+  lua_pushlightuserdata (L, urb);
+  return 1;
+}
+
+/// Pushes the result of a reaped isochronous URB: a table with the `lengths` and `status`
+/// (0 or an errno value) of each packet, the number of failed packets (`errors`), the
+/// `start_frame` and (for IN URBs) the received packets concatenated in `data`.
+static int reap_iso (lua_State *L, struct usbdevfs_urb *urb)
+{
+  int in = urb->endpoint & 0x80;
+  // -EXDEV: some of the packets failed, see their status
+  if (urb->status != 0 && urb->status != -EXDEV) {
+    int err = urb->status;
+    if (err != ENODEV) err = -err;
+    if (in) free (urb->buffer);
+    else luaLM_unregister_strong_proxy (L, urb);
+    free (urb);
+    lua_pushnil (L);
+    lua_pushstring (L, strerror (err)); // message
+    lua_pushboolean (L, err != EPIPE); // fatal
+    lua_pushnumber (L, err); // errno
+    return 5;
+  }
+  int packets = urb->number_of_packets;
+  lua_createtable (L, 0, 5);
+  lua_createtable (L, packets, 0);
+  lua_createtable (L, packets, 0);
+  for (int i = 0; i < packets; i++) {
+    struct usbdevfs_iso_packet_desc *d = &urb->iso_frame_desc[i];
+    lua_pushnumber (L, d->actual_length);
+    lua_rawseti (L, -3, i + 1);
+    lua_pushnumber (L, -(int)d->status);
+    lua_rawseti (L, -2, i + 1);
+  }
+  lua_setfield (L, -3, "status");
+  lua_setfield (L, -2, "lengths");
+  if (in) {
+    // the packets are received at their nominal offsets
+    luaL_Buffer b;
+    luaL_buffinit (L, &b);
+    size_t off = 0;
+    for (int i = 0; i < packets; i++) {
+      struct usbdevfs_iso_packet_desc *d = &urb->iso_frame_desc[i];
+      if (!d->status) luaL_addlstring (&b, (char *)urb->buffer + off, d->actual_length);
+      off += d->length;
+    }
+    luaL_pushresult (&b);
+    lua_setfield (L, -2, "data");
+    free (urb->buffer);
+  } else {
+    luaLM_unregister_strong_proxy (L, urb);
+  }
+  lua_pushnumber (L, urb->error_count);
+  lua_setfield (L, -2, "errors");
+  lua_pushnumber (L, urb->start_frame);
+  lua_setfield (L, -2, "start_frame");
+  free (urb);
+  return 2;
+}
+
+/// Reaps one URB and pushes its token and results. Returns the number of pushed values, 0 if
+/// there are no completed URBs or -1 on error (with `errno` set).
+static int reap_one (lua_State *L, int fd)
+{
   struct usbdevfs_urb *urb;
   if (ioctl(fd, USBDEVFS_REAPURBNDELAY, &urb) < 0) {
     if (errno == EAGAIN) return 0;
-    return luaLM_posix_error (L, NULL);
+    return -1;
   }
   lua_pushlightuserdata (L, urb->usercontext);
+  if (urb->usercontext != urb) { // a pool slot
+    struct urb_slot *slot = (struct urb_slot *)urb;
+    int ret = 2;
+    if (urb->status == 0 || urb->status == -EREMOTEIO) { // success
+      if (!(urb->endpoint & 0x80)) { // OUT
+        lua_pushnumber (L, urb->actual_length);
+      } else if (slot->view) { // IN as a view, the slot stays out of the pool
+        struct urb_pool *p = slot->pool;
+        luaLM_push_strong_proxy (L, &slot->pool);
+        push_view (L, slot, urb->actual_length);
+        lua_remove (L, -2);
+        luaLM_unregister_strong_proxy (L, &slot->pool);
+        p->inflight--;
+        return 2;
+      } else if (luaLM_push_strong_proxy (L, urb)) { // IN into a buffer
+        struct buffer *b = luaL_checkudata (L, -1, lua_buffer_mt);
+        lua_pop (L, 1);
+        if (!buffer_write (b, slot->buf, urb->actual_length)) {
+          // reported as the result of this URB, raising would lose the rest of a `reap_all` batch
+          lua_pushnil (L);
+          lua_pushfstring (L, "could not allocate %d bytes", urb->actual_length);
+          lua_pushboolean (L, 1); // fatal
+          lua_pushnumber (L, ENOMEM);
+          ret = 5;
+        } else {
+          lua_pushnumber (L, urb->actual_length);
+        }
+      } else { // IN
+        lua_pushlstring (L, slot->buf, urb->actual_length);
+      }
+    } else {
+      int err = urb->status;
+      if (err != ENODEV) err = -err;
+      lua_pushnil (L);
+      lua_pushstring (L, strerror (err)); // message
+      lua_pushboolean (L, err != EPIPE); // fatal
+      lua_pushnumber (L, err); // errno
+      ret = 5;
+    }
+    pool_put (L, slot);
+    return ret;
+  }
+  if (urb->type == USBDEVFS_URB_TYPE_ISO) return reap_iso (L, urb);
   if (urb->status == 0 || urb->status == -EREMOTEIO) { // success
     if (urb->endpoint & 0x80) { // IN
       lua_pushlstring (L, urb->buffer, urb->actual_length);
@@ -199,7 +713,44 @@ static int reap_urb (lua_State *L)
     lua_pushnumber (L, err); // errno
     return 5;
   }
-} 
+}
+
+static int reap_urb (lua_State *L)
+{
+  int fd = luaLM_checkfd (L, 1);
+  int n = reap_one (L, fd);
+  if (n < 0) return luaLM_posix_error (L, NULL);
+  return n;
+}
+
+/// `_usb.reap_all(fd, out, max = 64)` reaps all the completed URBs (but at most `max`) and
+/// stores their results in the `out` table as consecutive quintuples (token, result, message,
+/// fatal, errno, same as the values returned by `reap_urb`). Returns the number of reaped URBs
+/// and, if reaping failed, an error message and errno.
+static int reap_all (lua_State *L)
+{
+  int fd = luaLM_checkfd (L, 1);
+  luaL_checktype (L, 2, LUA_TTABLE);
+  int max = luaL_optinteger (L, 3, 64);
+  int count = 0;
+  while (count < max) {
+    int n = reap_one (L, fd);
+    if (n == 0) break;
+    if (n < 0) {
+      int err = errno;
+      lua_pushnumber (L, count);
+      errno = err;
+      luaLM_posix_error (L, NULL);
+      lua_remove (L, -3); // the nil
+      return 3;
+    }
+    for (int i = n; i < 5; i++) lua_pushnil (L);
+    for (int i = 5; i >= 1; i--) lua_rawseti (L, 2, count * 5 + i);
+    count++;
+  }
+  lua_pushnumber (L, count);
+  return 1;
+}
 
 static const struct luaL_reg funcs[] = {
   { "set_configuration",  set_configuration },
@@ -210,12 +761,20 @@ static const struct luaL_reg funcs[] = {
   { "disconnect_kernel",  disconnect_kernel },
   { "bulk_read",          bulk_read         },
   { "bulk_write",         bulk_write        },
+  { "interrupt_read",     interrupt_read    },
+  { "interrupt_write",    interrupt_write   },
+  { "iso_read",           iso_read          },
+  { "iso_write",          iso_write         },
   { "reap_urb",           reap_urb          },
+  { "reap_all",           reap_all          },
+  { "pool",               pool_new          },
   { NULL,                 NULL              },
 };
 
 int luaopen_usb (lua_State *L)
 {
+  luaLM_register_metatable (L, urb_pool_mt, pool_methods);
+  luaLM_register_metatable (L, urb_view_mt, view_methods);
   lua_newtable(L);
   luaL_register (L, NULL, funcs);
   return 1;
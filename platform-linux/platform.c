@@ -37,12 +37,16 @@ int luaopen_usb(lua_State *L);
 int luaopen_i2c(lua_State *L);
 int luaopen_spi(lua_State *L);
 int luaopen_mmap(lua_State *L);
+int luaopen_shmring(lua_State *L);
+int luaopen_uevent(lua_State *L);
 const struct luaL_reg platform_preloads[] = {
   { "udev",           luaopen_udev        },
   { "_usb",           luaopen_usb         },
   { "_i2c",           luaopen_i2c         },
   { "_spi",           luaopen_spi         },
   { "mmap",           luaopen_mmap        },
+  { "shmring",        luaopen_shmring     },
+  { "uevent",         luaopen_uevent      },
   { 0,                0                   },
 };
 
@@ -0,0 +1,285 @@
+///
+/// Shared memory transport for external processes.
+///
+/// A `memfd` holds two single-producer single-consumer byte rings, one for each direction.
+/// Messages are stored as a 4 byte header (24 bit length, 8 bit type) followed by the payload
+/// and may wrap around the end of the ring. The `head` and `tail` counters are free running and
+/// are only ever written by the producer and the consumer respectively.
+///
+/// The two processes also share a Unix socket pair used as a doorbell: the producer writes a
+/// byte into it whenever it puts a message into a ring the consumer had emptied, so the consumer
+/// can wait for it in the event loop. The other way round, a producer which finds the ring full
+/// sets the `waiting` flag of the ring and the consumer rings the doorbell once it frees space.
+/// The doorbell also reports the death of the peer (as EOF).
+///
+
+/// ## Necessary declarations
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "shmring.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#define SHMRING_MAGIC 0x676e6972 // "ring"
+#define SHMRING_HEADER 4
+#define SHMRING_MAX_MSG 0xffffff
+#define SHMRING_MIN_SIZE 4096
+
+struct shmring_side {
+  uint32_t head; // bytes put into the ring so far
+  uint8_t pad1[60];
+  uint32_t tail; // bytes consumed so far
+  uint32_t waiting; // set by the producer when it found the ring full
+  uint8_t pad2[56];
+};
+
+struct shmring_shared {
+  uint32_t magic;
+  uint32_t size; // of each ring (a power of two)
+  uint8_t pad[56];
+  struct shmring_side side[2]; // 0: creator → child, 1: child → creator
+  uint8_t data[];
+};
+
+struct shmring {
+  struct shmring_shared *sh;
+  size_t mapsize;
+  int memfd;
+  int bell;
+  int tx, rx;     // the sides we produce into and consume from
+  int remote[2];  // the memfd and the doorbell of the child (or -1)
+  char address[32];
+};
+
+//### ring buffer access
+
+static uint8_t *ring_data (struct shmring *r, int side)
+{
+  return r->sh->data + (size_t)side * r->sh->size;
+}
+
+static void ring_write (uint8_t *data, uint32_t size, uint32_t pos, const void *s, size_t len)
+{
+  uint32_t off = pos & (size - 1);
+  size_t first = size - off;
+  if (first >= len) {
+    memcpy (data + off, s, len);
+  } else {
+    memcpy (data + off, s, first);
+    memcpy (data, (const uint8_t *)s + first, len - first);
+  }
+}
+
+static void ring_read (const uint8_t *data, uint32_t size, uint32_t pos, void *d, size_t len)
+{
+  uint32_t off = pos & (size - 1);
+  size_t first = size - off;
+  if (first >= len) {
+    memcpy (d, data + off, len);
+  } else {
+    memcpy (d, data + off, first);
+    memcpy ((uint8_t *)d + first, data, len - first);
+  }
+}
+
+//### setup
+
+static struct shmring *shmring_map (int memfd, int bell, size_t mapsize)
+{
+  struct shmring *r = calloc (1, sizeof(struct shmring));
+  if (!r) return NULL;
+  void *p = mmap (NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (p == MAP_FAILED) { free (r); return NULL; }
+  r->sh = p;
+  r->mapsize = mapsize;
+  r->memfd = memfd;
+  r->bell = bell;
+  r->remote[0] = r->remote[1] = -1;
+  return r;
+}
+
+/// Creates a ring pair with `size` bytes in each direction (rounded up to a power of two). The
+/// child process should be given the string returned by `shmring_address` and its end of the
+/// descriptors closed with `shmring_close_remote` once it has been spawned.
+struct shmring *shmring_create (size_t size)
+{
+  uint32_t n = SHMRING_MIN_SIZE;
+  while (n < size && n < (1u << 30)) n <<= 1;
+  size_t mapsize = sizeof(struct shmring_shared) + 2 * (size_t)n;
+
+  int memfd = syscall (SYS_memfd_create, "thb-shmring", MFD_CLOEXEC);
+  if (memfd < 0) return NULL;
+  if (ftruncate (memfd, mapsize) < 0) { close (memfd); return NULL; }
+  int sv[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sv) < 0) {
+    close (memfd);
+    return NULL;
+  }
+  struct shmring *r = shmring_map (memfd, sv[0], mapsize);
+  if (!r) { close (memfd); close (sv[0]); close (sv[1]); return NULL; }
+  r->sh->magic = SHMRING_MAGIC;
+  r->sh->size = n;
+  r->tx = 0;
+  r->rx = 1;
+
+  // dup clears FD_CLOEXEC so only these copies are inherited by the child
+  r->remote[0] = dup (memfd);
+  r->remote[1] = dup (sv[1]);
+  close (sv[1]);
+  if (r->remote[0] < 0 || r->remote[1] < 0) { shmring_close (r); return NULL; }
+  snprintf (r->address, sizeof(r->address), "shm:%d:%d", r->remote[0], r->remote[1]);
+  return r;
+}
+
+/// Attaches to the ring pair described by the `address` returned by `shmring_address` in the
+/// parent process.
+struct shmring *shmring_attach (const char *address)
+{
+  int memfd, bell;
+  if (sscanf (address, "shm:%d:%d", &memfd, &bell) != 2) { errno = EINVAL; return NULL; }
+  struct stat st;
+  if (fstat (memfd, &st) < 0) return NULL;
+  if ((size_t)st.st_size < sizeof(struct shmring_shared)) { errno = EINVAL; return NULL; }
+  struct shmring *r = shmring_map (memfd, bell, st.st_size);
+  if (!r) return NULL;
+  if (r->sh->magic != SHMRING_MAGIC ||
+      sizeof(struct shmring_shared) + 2 * (size_t)r->sh->size > r->mapsize) {
+    munmap (r->sh, r->mapsize);
+    free (r);
+    errno = EINVAL;
+    return NULL;
+  }
+  r->tx = 1;
+  r->rx = 0;
+  fcntl (memfd, F_SETFD, FD_CLOEXEC);
+  fcntl (bell, F_SETFD, FD_CLOEXEC);
+  fcntl (bell, F_SETFL, fcntl (bell, F_GETFL) | O_NONBLOCK);
+  snprintf (r->address, sizeof(r->address), "shm:%d:%d", memfd, bell);
+  return r;
+}
+
+const char *shmring_address (struct shmring *r)
+{
+  return r->address;
+}
+
+void shmring_close_remote (struct shmring *r)
+{
+  for (int i = 0; i < 2; i++) {
+    if (r->remote[i] >= 0) close (r->remote[i]);
+    r->remote[i] = -1;
+  }
+}
+
+void shmring_close (struct shmring *r)
+{
+  shmring_close_remote (r);
+  if (r->sh) munmap (r->sh, r->mapsize);
+  if (r->memfd >= 0) close (r->memfd);
+  if (r->bell >= 0) close (r->bell);
+  free (r);
+}
+
+//### messages
+
+/// Returns the doorbell descriptor which becomes readable when new messages arrive (or when
+/// the other process exits).
+int shmring_fd (struct shmring *r)
+{
+  return r->bell;
+}
+
+/// Copies a message into the outgoing ring. Returns -1 with `errno` set to `EAGAIN` when there is
+/// not enough space left in the ring (the doorbell rings once the consumer frees some) or to
+/// `EMSGSIZE` when it would never fit.
+int shmring_send (struct shmring *r, unsigned type, const void *data, size_t len)
+{
+  struct shmring_side *s = &r->sh->side[r->tx];
+  uint32_t size = r->sh->size;
+  if (len > SHMRING_MAX_MSG || len + SHMRING_HEADER > size) { errno = EMSGSIZE; return -1; }
+  uint32_t head = s->head;
+  uint32_t tail = __atomic_load_n (&s->tail, __ATOMIC_ACQUIRE);
+  if (size - (head - tail) < len + SHMRING_HEADER) {
+    // check again after setting the flag, the consumer may have freed space in between
+    __atomic_store_n (&s->waiting, 1, __ATOMIC_SEQ_CST);
+    tail = __atomic_load_n (&s->tail, __ATOMIC_SEQ_CST);
+    if (size - (head - tail) < len + SHMRING_HEADER) { errno = EAGAIN; return -1; }
+    __atomic_store_n (&s->waiting, 0, __ATOMIC_SEQ_CST);
+  }
+
+  uint8_t *d = ring_data (r, r->tx);
+  uint8_t hdr[SHMRING_HEADER] = { len, len >> 8, len >> 16, type };
+  ring_write (d, size, head, hdr, SHMRING_HEADER);
+  ring_write (d, size, head + SHMRING_HEADER, data, len);
+  __atomic_store_n (&s->head, head + SHMRING_HEADER + len, __ATOMIC_SEQ_CST);
+
+  // the consumer stores its tail before checking the head again so either it sees this message
+  // or we see that it has drained the ring and may be waiting for the doorbell
+  if (__atomic_load_n (&s->tail, __ATOMIC_SEQ_CST) == head) {
+    char c = 0;
+    if (send (r->bell, &c, 1, MSG_NOSIGNAL) < 0 && errno != EAGAIN) return -1;
+  }
+  return 0;
+}
+
+/// Returns 1 and fills `m` with the next incoming message, returns 0 if there is none.
+int shmring_peek (struct shmring *r, struct shmring_msg *m)
+{
+  struct shmring_side *s = &r->sh->side[r->rx];
+  uint32_t size = r->sh->size;
+  uint32_t tail = s->tail;
+  uint32_t head = __atomic_load_n (&s->head, __ATOMIC_SEQ_CST);
+  if (head == tail) return 0;
+
+  const uint8_t *d = ring_data (r, r->rx);
+  uint8_t hdr[SHMRING_HEADER];
+  ring_read (d, size, tail, hdr, SHMRING_HEADER);
+  m->len = hdr[0] | hdr[1] << 8 | hdr[2] << 16;
+  m->type = hdr[3];
+  if (m->len > head - tail - SHMRING_HEADER) { errno = EPROTO; return -1; }
+
+  uint32_t off = (tail + SHMRING_HEADER) & (size - 1);
+  size_t first = size - off;
+  if (first > m->len) first = m->len;
+  m->seg[0] = d + off;
+  m->seglen[0] = first;
+  m->seg[1] = d;
+  m->seglen[1] = m->len - first;
+  return 1;
+}
+
+void shmring_consume (struct shmring *r, struct shmring_msg *m)
+{
+  struct shmring_side *s = &r->sh->side[r->rx];
+  __atomic_store_n (&s->tail, s->tail + SHMRING_HEADER + m->len, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n (&s->waiting, 0, __ATOMIC_SEQ_CST)) {
+    char c = 0;
+    send (r->bell, &c, 1, MSG_NOSIGNAL);
+  }
+}
+
+/// Empties the doorbell. Returns -1 (with `errno` set to `EPIPE`) when the other process is gone.
+int shmring_clear_bell (struct shmring *r)
+{
+  char buf[64];
+  while (1) {
+    ssize_t n = recv (r->bell, buf, sizeof(buf), 0);
+    if (n > 0) continue;
+    // a peer which exits without emptying its doorbell resets the connection
+    if (n == 0 || errno == ECONNRESET) { errno = EPIPE; return -1; }
+    if (errno == EINTR) continue;
+    return errno == EAGAIN ? 0 : -1;
+  }
+}
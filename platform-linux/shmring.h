@@ -0,0 +1,33 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// A pair of single-producer single-consumer rings in a shared memory file (one for each
+/// direction) plus a doorbell pipe for each of them. The creating process keeps one end of the
+/// pair and passes the other one to a child process as an address string.
+struct shmring;
+
+/// A received message. It may wrap around the end of the ring so it is returned in (at most)
+/// two segments. The data stays valid until `shmring_consume` is called.
+struct shmring_msg {
+  unsigned type;
+  size_t len;
+  const uint8_t *seg[2];
+  size_t seglen[2];
+};
+
+struct shmring *shmring_create (size_t size);
+struct shmring *shmring_attach (const char *address);
+const char *shmring_address (struct shmring *r);
+void shmring_close_remote (struct shmring *r);
+void shmring_close (struct shmring *r);
+
+int shmring_fd (struct shmring *r);
+int shmring_send (struct shmring *r, unsigned type, const void *data, size_t len);
+int shmring_peek (struct shmring *r, struct shmring_msg *m);
+void shmring_consume (struct shmring *r, struct shmring_msg *m);
+int shmring_clear_bell (struct shmring *r);
+
+#endif
@@ -84,8 +84,18 @@ static int io_raw_read (lua_State *L)
 {
   int fd = luaLM_checkfd (L, 1);
   int n = luaL_optint(L, 2, 100*1024);
-
-  char buffer[n];
+  luaL_argcheck (L, n > 0, 2, "the read size must be positive");
+
+  // one scratch buffer for all the reads (grown as needed) instead of a caller sized stack
+  // array or a garbage object per read, the data is copied into the result string anyway
+  static char *buffer;
+  static int buffer_size;
+  if (n > buffer_size) {
+    char *b = realloc (buffer, n);
+    if (!b) return luaL_error (L, "could not allocate %d bytes", n);
+    buffer = b;
+    buffer_size = n;
+  }
   int ret = read (fd, buffer, n);
   if (!ret) { // EOF
     lua_pushnil (L);
@@ -122,6 +132,84 @@ static int io_raw_write (lua_State *L)
   return 1;
 }
 
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "common/l_buffer.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // osx: sockets are set up not to raise SIGPIPE by luasocket
+#endif
+
+#define WRITEV_BATCH 64
+
+/// `io.raw_writev(fd, parts [, i [, off]])` writes the strings, buffers and buffer slices of the
+/// list `parts`, starting at byte `off` (0-based) of `parts[i]`, without concatenating them.
+/// Socket objects are written with `sendmsg` (so a closed connection is an error instead of a
+/// signal), descriptor numbers with `writev`. Returns the index and the offset of the first byte
+/// which was not written (`#parts + 1, 0` once everything is written) or `nil, error message,
+/// errno`. The message of a closed connection is "closed" (as in LuaSocket).
+static int io_raw_writev (lua_State *L)
+{
+  int fd = luaLM_checkfd (L, 1);
+  luaL_checktype (L, 2, LUA_TTABLE);
+  int n = lua_objlen (L, 2);
+  int i = luaL_optint (L, 3, 1);
+  size_t off = luaL_optnumber (L, 4, 0);
+  int sock = !lua_isnumber (L, 1);
+  luaL_checkstack (L, WRITEV_BATCH, "io.raw_writev");
+
+  while (i <= n) {
+    struct iovec iov[WRITEV_BATCH];
+    int cnt = 0;
+    // the parts stay on the stack until written (numbers are converted into new strings)
+    for (int j = i; j <= n && cnt < WRITEV_BATCH; j++, cnt++) {
+      lua_rawgeti (L, 2, j);
+      size_t len;
+      const char *s = lua_buffer_tolstring (L, -1, &len);
+      if (!s) return luaL_error (L, "io.raw_writev: invalid part %d (a %s)", j, luaL_typename (L, -1));
+      if (j == i) {
+        if (off > len) off = len;
+        s += off;
+        len -= off;
+      }
+      iov[cnt].iov_base = (void *)s;
+      iov[cnt].iov_len = len;
+    }
+    ssize_t ret = -1;
+    if (sock) {
+      struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+      ret = sendmsg (fd, &msg, MSG_NOSIGNAL);
+      if (ret < 0 && errno == ENOTSOCK) sock = 0;
+    }
+    if (!sock) ret = writev (fd, iov, cnt);
+    lua_pop (L, cnt);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == EPIPE || errno == ECONNRESET) {
+        lua_pushnil (L);
+        lua_pushliteral (L, "closed");
+        lua_pushnumber (L, errno);
+        return 3;
+      }
+      return luaLM_posix_error (L, "io.raw_writev");
+    }
+    size_t left = ret;
+    int k = 0;
+    while (k < cnt && left >= iov[k].iov_len) left -= iov[k++].iov_len;
+    if (k < cnt) { // short write, the descriptor is full
+      off = (k ? 0 : off) + left;
+      i += k;
+      break;
+    }
+    i += cnt;
+    off = 0;
+  }
+  lua_pushnumber (L, i);
+  lua_pushnumber (L, off);
+  return 2;
+}
+
 static int io_raw_close (lua_State *L)
 {
   int fd = luaLM_checkfd (L, 1);
@@ -292,6 +380,7 @@ void lua_init_platform_posix(lua_State *L)
   const struct luaL_reg io_additions[] = {
     { "raw_read",        io_raw_read        },
     { "raw_write",       io_raw_write       },
+    { "raw_writev",      io_raw_writev      },
     { "raw_close",       io_raw_close       },
     { "setinherit",      io_setinherit      },
     { "fsync",           io_fsync           },
@@ -3,8 +3,9 @@ local T = require'thread'
 local D = require'util'
 local loop = require'loop'
 local bio = require'bio'
-local O = require'o'
 local E = require'errno'
+local F = require'extframing'
+local SU = require'sepackusb'
 
 local verbose = false
 local ssub = string.sub
@@ -17,6 +18,8 @@ local function usage(err)
 Supported options:
   .p<product-name>
   .s<serial-number>
+  .d<URBs in flight>
+  .z<read transfer size>
 ]], arg[0]))
   if err then
     print(err)
@@ -37,7 +40,7 @@ if #arg < 1 then
 end
 
 local port = table.remove(arg, 1)
-if port == 'stdio' then
+if port == 'stdio' or string.startswith(port, 'shm:') then
   config.port = port
 else
   config.port = tonumber(port)
@@ -52,98 +55,165 @@ for i,arg in ipairs(arg) do
     config.product = ssub(arg, 3)
   elseif prefix == '.s' then
     config.serial = ssub(arg, 3)
+  elseif prefix == '.d' then
+    config.depth = tonumber(ssub(arg, 3)) or usage('invalid depth: '..arg)
+  elseif prefix == '.z' then
+    config.transfer_size = tonumber(ssub(arg, 3)) or usage('invalid transfer size: '..arg)
   else
     usage('unknown option: '..arg)
   end
 end
 
-local LeakyBucket = O()
-
-LeakyBucket.new = O.constructor(function (self, T)
-  self.T = T
-  self.t = 0
-  self.T0 = {}
-  self.T1 = {}
-end)
-
-function LeakyBucket:put(v)
-  local t = math.floor(T.now() / self.T)
-  local dt = t - self.t
-  if dt > 0 then
-    self.t = t
-    if dt > 1 then
-      self.T1 = {}
-    else
-      self.T1 = self.T0
-    end
-    self.T0 = {}
-  end
-  self.T0[#self.T0 + 1] = v
-  return v
-end
-
-function LeakyBucket:count()
-  return #self.T0 + #self.T1
-end
-
-function LeakyBucket:get()
-  local T = {}
-  for i=#self.T1,1,-1 do T[#T+1] = self.T1[i] end
-  for i=#self.T0,1,-1 do T[#T+1] = self.T0[i] end
-  return T
-end
-
-local errors = LeakyBucket:new(1)
+local errors = SU.ErrorRate:new(15)
 
 local function handle_error (msg, err, fatal, errc, errno)
-  if errc == "ENODEV" or errc == "ESHUTDOWN" or errc == "iokit/NoDevice" then
+  if SU.disconnected(errno) then
     eprintf("device diconnected\n")
     os.exit(2)
   end
   if verbose then D.red'ERROR:'(msg, err, errc, usb.fmt_errno(errno)) end
-  local str = errors:put(string.format("error: %s: %s [%s %s]\n", msg, err, errc, usb.fmt_errno(errno)))
-  if errors:count() > 15 then
+  if errors:put(string.format("error: %s: %s [%s %s]\n", msg, err, errc, usb.fmt_errno(errno))) then
     io.stderr:write("giving up after too many errors:\n")
-    for i,v in ipairs(errors:get()) do
+    for i,v in ipairs(errors:messages()) do
       io.stderr:write("  "..v)
     end
     os.exit(2)
-  else
-    io.stderr:write()
   end
 end
 
 local pin, pout
+local fdin, fdout
+-- the shared memory rings when started with a `shm:` address
+local ring
+
+-- set once the host switched to binary framing (see extframing.lua)
+local write_frame
+
+-- messages waiting for space in the ring
+local ring_pending = T.Fifo.new()
+
+-- Returns true once the message is in the ring, false if it is full and
+-- exits on any other error.
+local function ring_try (kind, data)
+  local ok, err = ring:send(data, kind)
+  if ok then return true end
+  if err ~= 'full' then
+    eprintf("error: ring send: %s\n", err)
+    os.exit(3)
+  end
+  return false
+end
+
+local function ring_put (kind, data)
+  if ring_pending:len() == 0 and ring_try(kind, data) then return end
+  ring_pending:push({ kind, data })
+  if ring_pending:len() > 1 then return end
+  T.go(function ()
+    while ring_pending:len() > 0 do
+      -- the host rings the doorbell once it has made space; empty it here as
+      -- well, `write_usb_ring` may be busy and would leave it readable
+      loop.wait_readable(ring)
+      if not ring:clear() then return end
+      while ring_pending:len() > 0 do
+        local m = ring_pending:peek()
+        if not ring_try(m[1], m[2]) then break end
+        ring_pending:pop()
+      end
+    end
+  end)
+end
+
+local function send_data (data)
+  if ring then
+    ring_put(F.DATA, data)
+  elseif write_frame then
+    loop.writev(fdout, { write_frame(F.DATA, data, nil, true) })
+  else
+    loop.writev(fdout, { #data, '\n', data, '\n' })
+  end
+end
+
+local function send_command (line)
+  if ring then
+    ring_put(F.COMMAND, line)
+  elseif write_frame then
+    loop.write(fdout, write_frame(F.COMMAND, line))
+  else
+    loop.write(fdout, line..'\n')
+  end
+end
+
+local function read_usb ()
+  SU.start_reads(pin, {
+    read_depth = config.depth,
+    read_size = config.transfer_size,
+    data = send_data,
+    error = function (err, fatal, errno)
+      handle_error("usb read", err, fatal, E[errno], errno)
+    end,
+  })
+end
 
-local function read_usb (fdout)
-  local read_cb, read
-  function read_cb(data, err, fatal, errno)
-    local errc = E[errno]
+local function usb_write (data)
+  if pout then
+    pout:write(data, function (ok, err, fatal, errno)
+      if not ok then handle_error("usb write", err, fatal, E[errno], errno) end
+    end)
+  end
+end
+
+local function write_usb_binary(ibuf)
+  local read_message = F.reader(ibuf)
+  while true do
+    local data, cmd, err = read_message()
     if data then
-      loop.write(fdout, #data..'\n'..data..'\n')
-      read()
+      usb_write(data)
+    elseif cmd then
+      eprintf("error: invalid command: %s\n", cmd)
+      os.exit(3)
+    elseif err == 'eof' then
+      os.exit(0)
     else
-      if errc ~= "iokit/Aborted" then
-        handle_error("usb read", err, fatal, errc, errno)
-      end
-      loop.run_after(.1, read)
+      eprintf("error: %s\n", err)
+      os.exit(3)
     end
   end
-  function read()
-    pin:read(2048, read_cb)
+end
+
+local function write_usb_ring()
+  while true do
+    local ok = ring:clear()
+    while true do
+      local data, kind = ring:recv()
+      if not data then
+        if kind then
+          eprintf("error: %s\n", kind)
+          os.exit(3)
+        end
+        break
+      end
+      if kind ~= F.DATA then
+        eprintf("error: invalid command: %s\n", data)
+        os.exit(3)
+      end
+      usb_write(data)
+    end
+    if not ok then os.exit(0) end
+    loop.wait_readable(ring)
   end
-  read()
-  read()
-  read()
-  read()
 end
 
-local function write_usb(fdin)
+local function write_usb()
   local ibuf = bio.IBuf:new(fdin)
   while true do
     local line = ibuf:readuntil('\n')
     if not line then os.exit(0) end
-    if #line > 0 then
+    if line == 'binary' then
+      -- acknowledge before the first framed message
+      loop.write(fdout, "binary\n")
+      write_frame = F.writer()
+      return write_usb_binary(ibuf)
+    elseif #line > 0 then
       local len = string.match(line, '^tx ([0-9]+)$')
       if len then
         local data = ibuf:read(len)
@@ -151,11 +221,7 @@ local function write_usb(fdin)
           eprintf("error: invalid data framing\n")
           os.exit(3)
         end
-        if pout then
-          pout:write(data, function (ok, err, fatal, errno)
-            if not ok then handle_error("usb write", err, fatal, E[errno], errno) end
-          end)
-        end
+        usb_write(data)
         if ibuf:read(1) ~= '\n' then
           eprintf("error: invalid data framing\n")
           os.exit(3)
@@ -168,10 +234,15 @@ local function write_usb(fdin)
   end
 end
 
-local fdin, fdout
-
 if config.port == 'stdio' then
   fdin = 0 fdout = 1
+elseif type(config.port) == 'string' then
+  local err
+  ring, err = require'shmring'.attach(config.port)
+  if not ring then
+    eprintf("error attaching to %s: %s", config.port, err)
+    os.exit(3)
+  end
 else
   local socket = require'socket'
   local sock, err = socket.connect('127.0.0.1', config.port)
@@ -183,35 +254,21 @@ else
   fdin = sock
   fdout = sock
 end
-T.go(write_usb, fdin)
+T.go(ring and write_usb_ring or write_usb)
 
 local function open_device(d)
-  local ok, err = T.spcall(d.open, d)
-  if not ok then
-    if err:endswith("USBDeviceOpen: (iokit/common) exclusive access and device already open (0xe00002c5)") then -- FIXME
-      eprintf("device busy: %s [%s]\n", d.product, d.serial)
-    else
-      return error(err)
-    end
-  end
-  ok, err = d:set_configuration(2)
-  if not ok then
-    if d.reset then
-      eprintf("error: set_configuration: %s\n", err)
-      eprintf("performing device reset\n")
-      assert(d:reset())
-      assert(d:set_configuration(2))
-    else
-      eprintf("error: set_configuration: %s\n", err)
-      os.exit(2)
-    end
+  pin, pout = SU.open(d, {
+    read_depth = config.depth,
+    read_size = config.transfer_size,
+    write_depth = config.depth,
+    log = function (msg) eprintf("error: %s\n", msg) end,
+  })
+  if not pin then
+    eprintf("device busy: %s [%s]\n", d.product, d.serial)
+    return
   end
-  local intf = assert(d:find_interfaces{ bInterfaceClass = 'ff' }[1], 'vendor interface not found')
-  assert(intf:open())
-  pin  = assert(intf:find_endpoints{'bulk', 'in'}[1])
-  pout = assert(intf:find_endpoints{'bulk', 'out'}[1])
-  loop.write(fdout, "connect "..d.serial.."\n")
-  T.go(read_usb, fdout)
+  send_command("connect "..d.serial)
+  T.go(read_usb)
   return true
 end
 
@@ -237,7 +294,7 @@ usb.watch{
   end,
   coldplug_end = function (_)
     if not found then
-      loop.write(fdout, "coldplug-end\n")
+      send_command("coldplug-end")
       --eprintf("coldplug end\n")
     end
   end,
@@ -1,6 +1,7 @@
 local b = require'_binary'
 local D = require'util'
 local B = require'binary'
+local T = require'thread'
 
 local VERBOSE = true --false
 
@@ -36,6 +37,11 @@ local l, d3, d4 = b.unpack(data, '>u2c0z', 5)
 asserteq (l, 11)
 asserteq (d3, "abcde")
 asserteq (d4, " QWE")
+-- a z field at the end of the data is empty
+local l, d3, d4 = b.unpack('ab', 'c2 z')
+asserteq (l, 2)
+asserteq (d3, "ab")
+asserteq (d4, "")
 
 asserteqtab (b.unpackbits(0x123e, 'a:4 b:4 c1:1 c2:1 c3:1 c4:1 d:4'), { a = 1, b = 2, c1 = false, c2 = false, c3 = true, c4 = true, d = 0xe })
 asserteqtab (b.unpackbits(0x123e, 'a:4 _:4 c1:1 _ c3:1 c4:1 d:4'), { a = 1, c1 = false, c3 = true, c4 = true, d = 0xe })
@@ -48,3 +54,26 @@ asserteq (b.b64_encode'pleasure.', 'cGxlYXN1cmUu')
 asserteq (b.b64_encode'easure.', 'ZWFzdXJlLg==')
 asserteq (b.b64_encode'pleasure.', 'cGxlYXN1cmUu')
 asserteq (b.b64_encode'sure.', 'c3VyZS4=')
+
+-- compiled plans
+local plan = b.compile'>s2s2u2c0z'
+asserteq (plan:size(), nil)
+asserteqtab ({plan:unpack(data)}, {#data - 3, -1, -16, "abcde", " QWE"})
+asserteqtab ({b.unpack(data, plan)}, {#data - 3, -1, -16, "abcde", " QWE"})
+asserteq (b.compile'<u2 _2 s4 f8':size(), 16)
+asserteqtab ({b.unpack('\255\255\255\254', '>s4')}, {4, -2})
+asserteqtab ({b.unpack('\254\255\255\255', '<u4')}, {4, 0xfffffffe})
+
+-- array decoding
+asserteqtab (b.unpack_array('\0\1\0\2\255\255', '>u2'), {1, 2, 65535})
+local dst = {9, 9, 9, 9, 9}
+asserteq (select(2, b.unpack_array('\1\0\0\0\2\0\0\0', '<s4', dst)), 2)
+asserteqtab (dst, {1, 2})
+local arr = b.unpack_array('\0\1\0\2\255\255', '>s2', 'array')
+asserteq (#arr, 3)
+asserteq (arr[3], -1)
+asserteq (arr[4], nil)
+asserteq (arr[0], nil)
+asserteq (arr[-1], nil)
+asserteq (T.spcall(b.unpack_array, '\0\1', '<u0'), false)
+asserteqtab (arr:totable(2), {2, -1})
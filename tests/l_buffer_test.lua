@@ -1,6 +1,7 @@
 local buffer = require'buffer'
 local D = require'util'
 local B = require'binary'
+local T = require'thread'
 
 local VERBOSE = false
 
@@ -73,3 +74,46 @@ d()
 asserteq (b:rseek (4), nil)
 asserteq (b:rseek (3), 3)
 d()
+
+-- slices keep their data after it is consumed and the buffer is reused
+b:write("hello world")
+local sl = b:readslice(5)
+asserteq (#sl, 5)
+asserteq (#b, 6)
+b:write(string.rep("x", 100))
+asserteq (sl:get(), "hello")
+asserteq (sl:sub(2, 3):get(), "el")
+asserteq (b:slice(2, 6):get(), "world")
+b:release()
+asserteq (#b, 0)
+asserteq (sl:get(2), "ello")
+local sl2 = B.hex2bin'0005 0102'
+b:write(sl2)
+local s3 = b:slice()
+local n, v = s3:peekstruct('>u2')
+asserteq (n, 2)
+asserteq (v, 5)
+asserteq (select(2, s3:peekstruct('>u2', 3)), 0x102)
+asserteq (b:readslice(5), nil)
+
+-- filling from a file descriptor
+local f = io.open('/dev/zero')
+asserteq (b:fill(f, 300000), 300000)
+asserteq (#b, 300004)
+asserteq (b:rseek(300004), 300004)
+asserteq (#b, 0)
+asserteq (b:fill(f, 10), 10)
+asserteq (b:read(), string.rep('\0', 10))
+asserteq (T.spcall(b.fill, b, f, 0), false)
+asserteq (T.spcall(b.fill, b, f, -1), false)
+f:close()
+
+-- readuntil resumes the search across partial writes
+b:write("GET / HTTP/1.1\r")
+asserteq (b:readuntil("\r\n\r\n"), nil)
+b:write("\nHost: x\r\n\r")
+asserteq (b:readuntil("\r\n\r\n"), nil)
+asserteq (b:readuntil("\n", 1), "GET / HTTP/1.1\r")
+b:write("\n")
+asserteq (b:readuntil("\r\n\r\n", 4), "Host: x")
+asserteq (#b, 0)
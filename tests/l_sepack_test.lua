@@ -0,0 +1,64 @@
+local S = require'_sepack'
+local D = require'util'
+local T = require'thread'
+
+local function asserteq (tv, v) if (tv ~= v) then error (D.p:format(tv) .. " ~= " .. D.p:format(v), 2) end end
+local function assertentry (out, i, id, data, flags, final)
+  local o = (i - 1) * 4
+  asserteq (out[o+1], id)
+  asserteq (out[o+2], data)
+  asserteq (out[o+3], flags)
+  asserteq (out[o+4], final)
+end
+
+local x62 = string.rep('x', 62)
+local x100 = string.rep('x', 100)
+
+-- header bits: the channel id in the low nibble, "more" in bit 4, the flags above
+asserteq (S.frame(3, 'abc'), '\3\3abc')
+asserteq (S.frame(3, 'abc', 5), '\163\3abc')
+asserteq (S.frame(15, ''), '\15\0')
+asserteq (T.spcall(S.frame, 16, 'a'), false)
+asserteq (T.spcall(S.frame, 1, 'a', 8), false)
+
+-- fragments of at most 62 bytes, all but the last with the "more" bit
+asserteq (S.frame(1, x100), '\17\62'..x62..'\1\38'..string.rep('x', 38))
+local out = {}
+asserteq (S.frames(2, x100, 1, out), 2)
+asserteq (out[1], '\50'..x62)
+asserteq (out[2], '\34'..string.rep('x', 38))
+asserteq (S.frames(2, x62, 0, out), 1)
+asserteq (out[1], '\2'..x62)
+
+-- fragments are merged, several channels in one transfer
+out = {}
+asserteq (S.demux(S.frame(1, x100)..S.frame(2, 'xy', 1), false, out), 2)
+assertentry (out, 1, 1, x100, 0, true)
+assertentry (out, 2, 2, 'xy', 1, true)
+
+-- a channel which did not finish its data in this transfer
+asserteq (S.demux('\17\1a\2\1b\17\1c', false, out), 3)
+assertentry (out, 1, 1, 'a', 0, false)
+assertentry (out, 2, 2, 'b', 0, true)
+assertentry (out, 3, 1, 'c', 0, false)
+
+-- same channel with other flags starts a new entry
+asserteq (S.demux('\17\1a\33\1b', false, out), 2)
+assertentry (out, 1, 1, 'a', 0, false)
+assertentry (out, 2, 1, 'b', 1, true)
+
+-- implicit lengths: one frame per transfer
+asserteq (S.demux('\18'..x62, true, out), 1)
+assertentry (out, 1, 2, x62, 0, false)
+asserteq (S.demux('\2', true, out), 1)
+assertentry (out, 1, 2, '', 0, true)
+
+-- truncated input keeps what is there, `out` is reused
+out = {}
+asserteq (S.demux('\1\5ab', false, out), 1)
+assertentry (out, 1, 1, 'ab', 0, true)
+asserteq (S.demux('\1\1a\2', false, out), 2)
+assertentry (out, 1, 1, 'a', 0, true)
+assertentry (out, 2, 2, '', 0, true)
+asserteq (S.demux('', false, out), 0)
+asserteq (out[1], 1)
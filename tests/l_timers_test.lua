@@ -0,0 +1,42 @@
+local T = require'thread'
+local loop = require'loop'
+local timers = require'timers'
+local D = require'util'
+
+local function asserteq (tv, v) if (tv ~= v) then error (D.p:format(tv) .. " ~= " .. D.p:format(v), 2) end end
+
+local fired = {}
+local t = timers.new(0.01, function (o) fired[#fired+1] = o end)
+
+local a = t:add(0.02, 'a')
+local b = t:add(0.02, 'b')
+local c = t:add(0.05, 'c')
+asserteq (select(3, t:stats()), 2) -- two ev_timer buckets
+asserteq (t:cancel(b), true)
+asserteq (t:cancel(b), false)
+asserteq (t:restart(c, 0.01), true)
+asserteq (t:restart(b, 0.01), false)
+
+-- errors go to on_error, the other timers of the bucket still fire
+local errors = {}
+local e = timers.new(0.01, function (o) if o == 'bad' then error('bad timer') end fired[#fired+1] = o end,
+  function (err) errors[#errors+1] = err end)
+e:add(0.03, 'bad')
+e:add(0.03, 'good')
+
+T.go(function ()
+  T.sleep(0.1)
+  asserteq (table.concat(fired, ' '), 'c a good')
+  asserteq (#errors, 1)
+  asserteq (errors[1]:match('bad timer') ~= nil, true)
+  asserteq (t:cancel(a), false)
+  asserteq ((t:stats()), 0)
+
+  local to = T.Timeout:new(0.01)
+  to:recv()
+  to:restart(0.02)
+  asserteq (to:poll(), nil)
+  to:cancel()
+  T.loop_stop()
+end)
+T.loop_run()
@@ -0,0 +1,37 @@
+local F = require'extframing'
+local buffer = require'buffer'
+local D = require'util'
+
+local function asserteq (tv, v) if (tv ~= v) then error (D.p:format(tv) .. " ~= " .. D.p:format(v), 2) end end
+
+local b = buffer.new()
+local ibuf = { read = function (_, n) return b:read(n) end }
+local write = F.writer()
+local read = F.reader(ibuf)
+
+asserteq (F.encode(F.DATA, 258, 'abc'), '\3\0\0\0\1\0\2\1abc')
+b:write(write(F.COMMAND, 'connect S1')..write(F.DATA, '')..write(F.DATA, string.rep('x', 70000)))
+asserteq (select(2, read()), 'connect S1')
+asserteq (read(), '')
+asserteq (#read(), 70000)
+
+-- multiplexed streams
+asserteq (F.encode(F.DATA, 1, 'a', 7), '\1\0\0\0\1\7\1\0a')
+b:write(write(F.DATA, 'dev', 3)..write(F.COMMAND, 'disconnect', 4))
+asserteq (select(4, read()), 3)
+local _, cmd, _, stream = read()
+asserteq (cmd, 'disconnect')
+asserteq (stream, 4)
+
+-- the header and the payload separately (for loop.writev)
+local h, payload = write(F.DATA, 'split', 2, true)
+asserteq (#h, F.HEADER_SIZE)
+b:write(h..payload)
+asserteq (read(), 'split')
+
+-- a lost message
+write(F.DATA, 'lost')
+b:write(write(F.DATA, 'zz'))
+local data, cmd, err = read()
+asserteq (data, nil)
+asserteq (err, 'framing error: sequence number 7, expected 6')
@@ -0,0 +1,34 @@
+local shmring = require'shmring'
+local D = require'util'
+
+local function asserteq (tv, v) if (tv ~= v) then error (D.p:format(tv) .. " ~= " .. D.p:format(v), 2) end end
+
+-- both ends in one process (the child would get the address on its command line)
+local a = assert(shmring.new(100))
+local b = assert(shmring.attach(a:address()))
+
+asserteq (a:send('hello'), true)
+asserteq (a:send('', 2), true)
+asserteq (b:clear(), true)
+local data, kind = b:recv()
+asserteq (data, 'hello')
+asserteq (kind, 1)
+data, kind = b:recv()
+asserteq (data, '')
+asserteq (kind, 2)
+asserteq (b:recv(), nil)
+
+-- the rings are at least 4 KiB, messages wrap around their end
+local big = string.rep('y', 3000)
+for i=1,20 do
+  asserteq (b:send(big..i), true)
+  asserteq (select(2, b:send(big)), 'full')
+  asserteq (a:recv(), big..i)
+  asserteq (a:recv(), nil)
+end
+
+-- the doorbell reports EOF once the other end is closed
+a:close_remote()
+b:close()
+asserteq (select(2, a:clear()), 'eof')
+a:close()
@@ -0,0 +1,85 @@
+local T = require'thread'
+local D = require'util'
+
+local function asserteq (tv, v) if (tv ~= v) then error (D.p:format(tv) .. " ~= " .. D.p:format(v), 2) end end
+
+-- run queue order: FIFO within a priority class, higher classes first
+local order = {}
+T.go(function ()
+  for _, n in ipairs{'b', 'c', 'd'} do
+    T.go(function () order[#order+1] = n end)
+  end
+  T.setpriority('low', T.go(function () order[#order+1] = 'low' end))
+  T.setpriority('high', T.go(function () order[#order+1] = 'high' end))
+  order[#order+1] = 'a'
+end)
+asserteq (table.concat(order, ' '), 'a high b c d low')
+
+local info = T.runqueue_info()
+asserteq (info.depth, 0)
+asserteq (info.max_depth, 5)
+asserteq (T.runqueue_info().max_depth, 0)
+
+-- a thread moved to another class and back is queued once, behind the others
+order = {}
+local depths
+T.go(function ()
+  local p = T.go(function () order[#order+1] = 'p' end)
+  T.go(function () order[#order+1] = 'q' end)
+  T.setpriority('high', p)
+  T.setpriority('normal', p)
+  depths = T.runqueue_info().depths
+end)
+asserteq (table.concat(order, ' '), 'q p')
+asserteq (depths.normal, 2)
+asserteq (depths.high, 0)
+
+-- bounded mailboxes
+local m = T.Mailbox:new(2, 'drop-oldest')
+for i=1,5 do m:put(i) end
+asserteq (m:recv(), 4)
+asserteq (m:recv(), 5)
+asserteq (m:stats().dropped, 3)
+asserteq (m:stats().hwm, 2)
+
+m = T.Mailbox:new(2, 'drop-newest')
+for i=1,5 do m:put(i) end
+m:putback(0)
+asserteq (m:recv(), 0)
+asserteq (m:recv(), 1)
+asserteq (m:recv(), 2)
+asserteq (m:stats().depth, 0)
+
+m = T.Mailbox:new(2)
+local got = {}
+T.go(function ()
+  for i=1,5 do m:put(i) end
+  got[#got+1] = 'done'
+end)
+asserteq (m:stats().depth, 2)
+T.go(function ()
+  for i=1,5 do got[#got+1] = m:recv() end
+end)
+asserteq (table.concat(got, ' '), '1 2 3 4 5 done')
+asserteq (m:stats().hwm, 2)
+asserteq (m:stats().blocked, 1)
+
+-- thread mailboxes
+local thd = T.go(function ()
+  got = {}
+  for i=1,3 do got[#got+1] = T.ThreadMailbox:recv() end
+end)
+T.go(function () for i=1,3 do T.send(thd, i) end end)
+asserteq (table.concat(got, ' '), '1 2 3')
+
+-- latency histograms
+local H = require'histogram'
+local h = H:new()
+for i=1,1000 do h:record(i / 1000) end
+asserteq (h.count, 1000)
+asserteq (h:quantile(.5), 0.53125)
+asserteq (h:quantile(1), 1)
+local info = T.latency_info(true)
+assert (next(info), 'no latency histograms recorded')
+for name,t in pairs(info) do assert (t.runtime.count > 0 and t.runtime.p99 >= t.runtime.p50, name) end
+asserteq (next(T.latency_info()), nil)
@@ -0,0 +1,270 @@
+local usb = require'usb'
+local T = require'thread'
+local D = require'util'
+local loop = require'loop'
+local bio = require'bio'
+local E = require'errno'
+local F = require'extframing'
+local SU = require'sepackusb'
+
+-- Serves all the sepack devices of the host over a single connection, the
+-- multiplexing counterpart of `raw-usb.lua` (see `lualib/usbbroker.lua` for
+-- the other end). The connection always uses binary framing, stream 0 carries
+-- the commands of the host:
+--
+--   open <stream> <product or -> <serial or ->
+--   close <stream>
+--
+-- Every open stream is given the first free device matching it. Its status
+-- messages ("connect <serial>", "coldplug-end" and "disconnect") and the
+-- received packets are sent on that stream and the data the host sends on it
+-- goes to the device.
+
+local ssub = string.sub
+
+local function usage(err)
+  print(string.format([[Usage:
+	%s <port-no>|stdio <options>
+
+Supported options:
+  .d<URBs in flight>
+  .z<read transfer size>
+]], arg[0]))
+  if err then
+    print(err)
+  end
+  os.exit(1)
+end
+
+local function eprintf(...)
+  io.stderr:write(string.format(...))
+end
+
+local config = {}
+
+if #arg < 1 then
+  usage()
+end
+
+local port = table.remove(arg, 1)
+if port == 'stdio' then
+  config.port = port
+else
+  config.port = tonumber(port)
+end
+if not config.port then
+  usage()
+end
+
+for i,arg in ipairs(arg) do
+  local prefix = ssub(arg, 1, 2)
+  if prefix == '.d' then
+    config.depth = tonumber(ssub(arg, 3)) or usage('invalid depth: '..arg)
+  elseif prefix == '.z' then
+    config.transfer_size = tonumber(ssub(arg, 3)) or usage('invalid transfer size: '..arg)
+  else
+    usage('unknown option: '..arg)
+  end
+end
+
+local fdin, fdout
+local write_frame
+
+local streams = {}  -- stream id -> { id, product, serial, dev, pin, pout, errors }
+local present = {}  -- the matching devices in the order they appeared
+local owner = {}    -- device -> stream
+local coldplug_done
+
+local function send(s, kind, data)
+  if write_frame then loop.writev(fdout, { write_frame(kind, data, s.id, true) }) end
+end
+
+local function matches(s, d)
+  return (not s.product or d.product == s.product) and (not s.serial or d.serial == s.serial)
+end
+
+local assign
+
+local function forget(d)
+  for i,v in ipairs(present) do
+    if v == d then return table.remove(present, i) end
+  end
+end
+
+-- Closes the device of stream `s`. The stream gets the next matching device,
+-- after `delay` seconds if given (like respawning `raw-usb` would).
+local function drop(s, delay)
+  local d = s.dev
+  if not d then return end
+  if s.pin.stop_reading then s.pin:stop_reading() end
+  s.dev, s.pin, s.pout = nil, nil, nil
+  owner[d] = nil
+  if d.wrwatch_stop then d.wrwatch_stop() end
+  T.spcall(d.close, d)
+  if streams[s.id] ~= s then return end
+  send(s, F.COMMAND, 'disconnect')
+  if delay then
+    T.go(function () T.sleep(delay) if streams[s.id] == s and not s.dev then assign(s) end end)
+  else
+    assign(s)
+  end
+end
+
+local function handle_error(s, msg, err, fatal, errno)
+  if SU.disconnected(errno) then
+    eprintf("device disconnected: %s\n", s.dev and s.dev.serial)
+    -- do not wait for udev to tell us
+    forget(s.dev)
+    return drop(s)
+  end
+  local errc = E[errno]
+  eprintf("error: %s: %s: %s [%s %s]\n", s.dev and s.dev.serial, msg, err, errc, usb.fmt_errno(errno))
+  if s.errors:put(msg) then
+    eprintf("giving up after too many errors\n")
+    s.errors:reset()
+    return drop(s, 1)
+  end
+end
+
+local function open_device(s, d)
+  local pin, pout = SU.open(d, {
+    read_depth = config.depth,
+    read_size = config.transfer_size,
+    write_depth = config.depth,
+    log = function (msg) eprintf("error: %s\n", msg) end,
+  })
+  if not pin then error('device busy', 0) end
+  s.pin, s.pout = pin, pout
+  s.dev = d
+  s.errors = SU.ErrorRate:new(15)
+  owner[d] = s
+  send(s, F.COMMAND, 'connect '..d.serial)
+  SU.start_reads(pin, {
+    read_depth = config.depth,
+    read_size = config.transfer_size,
+    active = function () return s.pin == pin end,
+    data = function (data) send(s, F.DATA, data) end,
+    error = function (err, fatal, errno) handle_error(s, "usb read", err, fatal, errno) end,
+  })
+end
+
+-- gives stream `s` the first free matching device
+function assign(s)
+  for _,d in ipairs(present) do
+    if not owner[d] and matches(s, d) then
+      local ok, err = T.spcall(open_device, s, d)
+      if ok then return true end
+      eprintf("error: open_device %s: %s\n", d.serial, D.unq(err))
+      s.pin, s.pout = nil, nil
+      T.spcall(d.close, d)
+    end
+  end
+end
+
+local function handle_command(line)
+  local cmd, id, product, serial = string.splitv(line, ' ')
+  id = tonumber(id)
+  if not id or id < 1 or id > 255 then
+    eprintf("error: invalid command: %s\n", line)
+    os.exit(3)
+  end
+  if cmd == 'open' then
+    if streams[id] then
+      local old = streams[id]
+      streams[id] = nil
+      drop(old)
+    end
+    local s = {
+      id = id,
+      product = product ~= '-' and product or nil,
+      serial = serial ~= '-' and serial or nil,
+      errors = SU.ErrorRate:new(15),
+    }
+    streams[id] = s
+    if not assign(s) and coldplug_done then send(s, F.COMMAND, 'coldplug-end') end
+  elseif cmd == 'close' then
+    local s = streams[id]
+    if not s then return end
+    streams[id] = nil
+    local d = s.dev
+    drop(s)
+    -- hand the device over to a stream waiting for it
+    if d then
+      for _,w in pairs(streams) do
+        if not w.dev and matches(w, d) and assign(w) then break end
+      end
+    end
+  else
+    eprintf("error: invalid command: %s\n", line)
+    os.exit(3)
+  end
+end
+
+local function read_host()
+  local ibuf = bio.IBuf:new(fdin)
+  if ibuf:readuntil('\n') ~= 'binary' then
+    eprintf("error: binary framing expected\n")
+    os.exit(3)
+  end
+  loop.write(fdout, "binary\n")
+  write_frame = F.writer()
+  local read_message = F.reader(ibuf)
+  while true do
+    local data, cmd, err, stream = read_message()
+    if data then
+      local s = streams[stream]
+      if s and s.pout then
+        s.pout:write(data, function (ok, err, fatal, errno)
+          if not ok and s.pout then handle_error(s, "usb write", err, fatal, errno) end
+        end)
+      end
+    elseif cmd then
+      handle_command(cmd)
+    elseif err == 'eof' then
+      os.exit(0)
+    else
+      eprintf("error: %s\n", err)
+      os.exit(3)
+    end
+  end
+end
+
+if config.port == 'stdio' then
+  fdin = 0 fdout = 1
+else
+  local socket = require'socket'
+  local sock, err = socket.connect('127.0.0.1', config.port)
+  if not sock then
+    eprintf("error connecting to port %d: %s", config.port, err)
+    os.exit(3)
+  end
+  sock:settimeout(0)
+  fdin = sock
+  fdout = sock
+end
+T.go(read_host)
+
+usb.watch{
+  idVendor = '16d0',
+  idProduct = '0450',
+  bcdDevice = '0100',
+
+  connect = function (d)
+    present[#present+1] = d
+    for _,s in pairs(streams) do
+      if not s.dev and matches(s, d) and assign(s) then break end
+    end
+  end,
+  disconnect = function (d)
+    forget(d)
+    if owner[d] then drop(owner[d]) end
+  end,
+  coldplug_end = function ()
+    coldplug_done = true
+    for _,s in pairs(streams) do
+      if not s.dev then send(s, F.COMMAND, 'coldplug-end') end
+    end
+  end,
+}
+
+loop.run()